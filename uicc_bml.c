@@ -1,13 +1,12 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "uicc_bml.h"
 
 // Header magic number, len = 14
 static const uint8_t header_magic[] =
 {0x00, 0x12, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x53, 0x43, 0x42, 0x69, 0x6E};
-static uint32_t ts_pointer_list_count = 0;
-static struct ub_ts_pointer* ts_pointer_list[256];
 
 static const struct ts_prop_type {
     uint8_t b1, b2, b3;
@@ -68,15 +67,17 @@ static const struct ac_prop_data_item {
 static const struct object_type_name_pair {
     enum ub_object_type type;
     const char* name;
+    const char* element;    // In the Ribbon markup
 } object_type_name_mapping[] = {
-    {UBO_ToggleButton, "Toggle Button"},
-    {UBO_Group, "Group"},
-    {UBO_Button, "Button"},
-    {UBO_FileMenu, "\"File\" Menu"},
-    {UBO_Gallery, "Gallery"},
-    {UBO_MenuGroup, "MenuGroup"},
-    {UBO_Tab, "Tab"},
-    {UBO_QAT, "Quick Access Bar (Qat)"}
+    {UBO_ToggleButton, "Toggle Button", "ToggleButton"},
+    {UBO_Group, "Group", "Group"},
+    {UBO_Button, "Button", "Button"},
+    {UBO_FileMenu, "\"File\" Menu", "ApplicationMenu"},
+    {UBO_Gallery, "Gallery", "Gallery"},
+    {UBO_MenuGroup, "MenuGroup", "MenuGroup"},
+    {UBO_Tab, "Tab", "Tab"},
+    {UBO_Ribbon, "Ribbon", "Ribbon"},
+    {UBO_QAT, "Quick Access Bar (Qat)", "QuickAccessToolbar"}
 };
 
 struct ts_prop_type* ub_ts_prop_type_from_bin(uint8_t b1, uint8_t b2, uint8_t b3) {
@@ -99,6 +100,11 @@ struct ac_prop_data_item* ub_prop_data_from_type(enum ub_ac_property_type type)
     return NULL;
 }
 
+int ub_ac_prop_len(enum ub_ac_property_type type) {
+    struct ac_prop_data_item* pdi = ub_prop_data_from_type(type);
+    return pdi == NULL ? -1 : pdi->len;
+}
+
 char* ub_prop_type_str(enum ub_ac_property_type type) {
     struct ac_prop_data_item* pdi = ub_prop_data_from_type(type);
     return pdi == NULL ? "Unknown Type" : pdi->name;
@@ -112,11 +118,31 @@ const char* ub_obj_type_str(enum ub_object_type type) {
     return "Unknown Type";
 }
 
-int ub_ts_prop_len(struct ub_ts_prop* prop) {
-    struct ts_prop_type* type = ub_ts_prop_type_from_bin(prop->type_b1, prop->type_b2, prop->type_b3);
-    return type == NULL ? prop->type_b1 : type->len;
+const char* ub_obj_type_element(enum ub_object_type type) {
+    for (int i = 0; i < sizeof(object_type_name_mapping) / sizeof(object_type_name_mapping[1]); i++) {
+        if (object_type_name_mapping[i].type == type)
+            return object_type_name_mapping[i].element;
+    }
+    return NULL;
+}
+
+int ub_obj_type_from_element(const char* name, size_t len) {
+    for (int i = 0; i < sizeof(object_type_name_mapping) / sizeof(object_type_name_mapping[1]); i++) {
+        const char* element = object_type_name_mapping[i].element;
+        if (strlen(element) == len && strncmp(name, element, len) == 0)
+            return object_type_name_mapping[i].type;
+    }
+    return -1;
 }
 
+int ub_ts_prop_len_from_bin(uint8_t b1, uint8_t b2, uint8_t b3) {
+    struct ts_prop_type* type = ub_ts_prop_type_from_bin(b1, b2, b3);
+    return type == NULL ? ts_prop_guess_length(b1, b2, b3) : type->len;
+}
+
+int ub_ts_prop_len(struct ub_ts_prop* prop) {
+    return ub_ts_prop_len_from_bin(prop->type_b1, prop->type_b2, prop->type_b3);
+}
 
 const char* ub_ts_prop_name_str(struct ub_ts_prop* prop) {
     struct ts_prop_type* type = ub_ts_prop_type_from_bin(prop->type_b1, prop->type_b2, prop->type_b3);
@@ -137,6 +163,17 @@ int ub_check_header(FILE* hFile) {
 	return 1;
 }
 
+int ub_check_header_buf(const uint8_t* data, uint32_t size) {
+	if (size < sizeof(header_magic))
+		return 0;
+
+	for (int i = 0; i < sizeof(header_magic); i++) {
+		if (data[i] != header_magic[i])
+			return 0;
+	}
+	return 1;
+}
+
 uint8_t ub_byte(FILE* hFile) {
 	uint8_t buf;
 	fread(&buf, 1, sizeof(uint8_t), hFile);
@@ -156,6 +193,51 @@ uint32_t ub_dword(FILE* hFile) {
 }
 
 
+uint16_t ub_buf_word(const uint8_t* ptr) {
+    return ptr[0] | (ptr[1] << 8);
+}
+
+uint32_t ub_buf_dword(const uint8_t* ptr) {
+    return ptr[0] | (ptr[1] << 8) | (ptr[2] << 16) | ((uint32_t)ptr[3] << 24);
+}
+
+int ub_utf16_get(const uint8_t* ptr, uint32_t count, uint32_t* c) {
+    *c = ub_buf_word(ptr);
+    if (*c >= 0xD800 && *c <= 0xDBFF && count > 1) {
+        uint32_t low = ub_buf_word(ptr + 2);
+        if (low >= 0xDC00 && low <= 0xDFFF) {
+            *c = 0x10000 + ((*c - 0xD800) << 10) + (low - 0xDC00);
+            return 2;
+        }
+    }
+    if (*c >= 0xD800 && *c <= 0xDFFF)
+        *c = 0xFFFD;
+    return 1;
+}
+
+int ub_utf8_put(uint32_t c, uint8_t* out) {
+    if (c < 0x80) {
+        out[0] = c;
+        return 1;
+    }
+    if (c < 0x800) {
+        out[0] = 0xC0 | (c >> 6);
+        out[1] = 0x80 | (c & 0x3F);
+        return 2;
+    }
+    if (c < 0x10000) {
+        out[0] = 0xE0 | (c >> 12);
+        out[1] = 0x80 | ((c >> 6) & 0x3F);
+        out[2] = 0x80 | (c & 0x3F);
+        return 3;
+    }
+    out[0] = 0xF0 | (c >> 18);
+    out[1] = 0x80 | ((c >> 12) & 0x3F);
+    out[2] = 0x80 | ((c >> 6) & 0x3F);
+    out[3] = 0x80 | (c & 0x3F);
+    return 4;
+}
+
 int ub_parse_uss(FILE* hFile, struct ub_uss** ret) {
     long startPos = ftell(hFile);
 
@@ -170,12 +252,16 @@ int ub_parse_uss(FILE* hFile, struct ub_uss** ret) {
 
     struct ub_uss* uss = malloc(sizeof(struct ub_uss) + sizeof(char*)*count);
     uss->length = length;
+    uss->fpos = startPos;
     uss->count = count;
     uss->strings = uss + 1;
 
     for (int i = 0; i < uss->count; i++) {
-        if (ub_byte(hFile) != 0x01)
+        if (ub_byte(hFile) != 0x01) {
+            uss->count = i;
+            ub_free_uss(uss);
             return UB_ERRMSG(UB_SRC_USS, UB_MSG_INVALID_FORMAT);
+        }
 
         uint16_t lenStr = ub_word(hFile);
 
@@ -184,8 +270,10 @@ int ub_parse_uss(FILE* hFile, struct ub_uss** ret) {
         uss->strings[i][lenStr] = 0; // Add the terminator
     }
 
-    if (ftell(hFile) != startPos + uss->length)
+    if (ftell(hFile) != startPos + uss->length) {
+        ub_free_uss(uss);
         return UB_ERRMSG(UB_SRC_USS, UB_MSG_INVALID_LENGTH);
+    }
 
     *ret = uss;
     return UB_OK;
@@ -205,13 +293,18 @@ int ub_parse_ac(FILE* hFile, struct ub_ac** ret) {
     uint32_t count = ub_dword(hFile);
 
     struct ub_ac* ac = malloc(sizeof(struct ub_ac) + count * sizeof(struct ub_ac_tag*));
+    if (ac == NULL)
+        return UB_FAILED;
     ac->count = count;
     ac->tags = (struct ub_ac_tag**) (ac + 1);
 
     for (int i = 0; i < count; i++) {
         uint16_t id = ub_word(hFile);
-        if (ub_word(hFile) != 0x0000)
+        if (ub_word(hFile) != 0x0000) {
+            ac->count = i;  // Free only the tags read so far
+            ub_free_ac(ac);
             return UB_ERRMSG(UB_SRC_AC, UB_MSG_INVALID_FORMAT);
+        }
         uint8_t count = ub_byte(hFile);
 
         struct ub_ac_tag* tag = malloc(sizeof(struct ub_ac_tag) + sizeof(struct ub_ac_pair*) * count);
@@ -223,6 +316,7 @@ int ub_parse_ac(FILE* hFile, struct ub_ac** ret) {
 
         for (int j = 0; j < ac->tags[i]->count; j++) {
             struct ub_ac_pair* prop = malloc(sizeof(struct ub_ac_pair));
+            prop->fpos = ftell(hFile);
             prop->type = ub_byte(hFile);
             prop->value = ub_dword(hFile);
             prop->auxdata = 0;
@@ -252,8 +346,29 @@ void ub_free_ac(struct ub_ac* ac) {
     free(ac);
 }
 
+// Open addressing, at most half full
+static void ub_ss_build_index(struct ub_ss* ss) {
+    uint32_t size = 16;
+    while (size < ss->count * 2)
+        size *= 2;
+    ss->index_mask = size - 1;
+    ss->index = calloc(size, sizeof(uint32_t));
+
+    for (uint32_t i = 0; i < ss->count; i++) {
+        uint32_t slot = ub_ss_hash(ss->strings[i]->id) & ss->index_mask;
+        while (ss->index[slot] != 0) {
+            if (ss->strings[ss->index[slot] - 1]->id == ss->strings[i]->id)
+                break;  // Keep the first one
+            slot = (slot + 1) & ss->index_mask;
+        }
+        if (ss->index[slot] == 0)
+            ss->index[slot] = i + 1;
+    }
+}
+
 int ub_parse_ss(FILE* hFile, struct ub_ss** ret) {
     *ret = 0;
+    long startPos = ftell(hFile);
 
     if (ub_byte(hFile) != 0x10)
         return UB_ERRMSG(UB_SRC_SS, UB_MSG_INVALID_HEADER);
@@ -261,19 +376,25 @@ int ub_parse_ss(FILE* hFile, struct ub_ss** ret) {
     uint32_t length = ub_dword(hFile);
     uint32_t count = ub_dword(hFile);
     struct ub_ss* ss = (struct ub_ss*)malloc(sizeof(struct ub_ss) + count * sizeof(struct ub_ss_string*));
+    if (ss == NULL)
+        return UB_FAILED;
     ss->length = length;
+    ss->fpos = startPos;
     ss->count = count;
     ss->strings = (struct ub_ss_string*) (ss + 1);
+    ss->index = NULL;
 
-    for (int i = 0; i < ss->count; i++) {
+    for (uint32_t i = 0; i < count; i++) {
         long pos = ftell(hFile);
         uint16_t id = ub_word(hFile);
-        if (ub_word(hFile) != 0x0000)
-            return UB_ERRMSG(UB_SRC_SS, UB_MSG_INVALID_FORMAT);
+        uint16_t zero = ub_word(hFile);
         uint16_t obj_type = ub_word(hFile);
         uint16_t magic = ub_word(hFile);
-        if (magic != 0x1000)
-           ;//return UB_ERRMSG(UB_SRC_SS, UB_MSG_INVALID_FORMAT);
+        if (zero != 0x0000 || (magic != 0x1000 && !(magic == 0x0000 && obj_type == 0x0001))) {
+            ss->count = i;  // Free only the strings read so far
+            ub_free_ss(ss);
+            return UB_ERRMSG(UB_SRC_SS, UB_MSG_INVALID_FORMAT);
+        }
         uint16_t lenwchar = ub_word(hFile);
 
         struct ub_ss_string* ss_string = malloc(sizeof(struct ub_ss_string) + lenwchar + 2);
@@ -281,24 +402,38 @@ int ub_parse_ss(FILE* hFile, struct ub_ss** ret) {
         ss_string->id = id;
         ss_string->type = obj_type;
         ss_string->length = lenwchar;
+        ss_string->fpos = pos;
         ss_string->wchars = (uint16_t*)(ss_string + 1);
 
         fread(ss_string->wchars, 1, lenwchar, hFile);
         ss_string->wchars[lenwchar >> 1] = 0x0000;
     }
 
+    ub_ss_build_index(ss);
 
     *ret = ss;
     return UB_OK;
 }
 
-const uint16_t* ub_ss_get(struct ub_ss* ss, uint16_t id) {
-    for (int i = 0; i < ss->count; i++) {
-        if (ss->strings[i]->id == id)
-            return ss->strings[i]->wchars;
+uint32_t ub_ss_hash(uint16_t id) {
+    return id * 40503u;
+}
+
+struct ub_ss_string* ub_ss_find(struct ub_ss* ss, uint16_t id) {
+    uint32_t slot = ub_ss_hash(id) & ss->index_mask;
+    while (ss->index[slot] != 0) {
+        struct ub_ss_string* ss_string = ss->strings[ss->index[slot] - 1];
+        if (ss_string->id == id)
+            return ss_string;
+        slot = (slot + 1) & ss->index_mask;
     }
 
-    return L"INVALID_SS_ID";
+    return NULL;
+}
+
+const uint16_t* ub_ss_get(struct ub_ss* ss, uint16_t id) {
+    struct ub_ss_string* ss_string = ub_ss_find(ss, id);
+    return ss_string == NULL ? L"INVALID_SS_ID" : ss_string->wchars;
 }
 
 void ub_free_ss(struct ub_ss* ss) {
@@ -306,28 +441,29 @@ void ub_free_ss(struct ub_ss* ss) {
         if (ss->strings[i] != NULL)
             free(ss->strings[i]);
     }
+    free(ss->index);
     free(ss);
 }
 
-int ub_parse_ts_tag(FILE* hFile, void** ret) {
+int ub_parse_ts_tag(FILE* hFile, struct ub_doc* doc, void** ret) {
     *ret = 0;
 
     enum ub_ts_type tag_type= ub_byte(hFile);
     switch (tag_type) {
     case UB_TST_NODE:
-        return ub_parse_ts_node(hFile, ret);
+        return ub_parse_ts_node(hFile, doc, ret);
     case UB_TST_PROP:
         return ub_parse_ts_prop(hFile, ret);
     case UB_TST_COLLECTION:
-        return ub_parse_ts_collection(hFile, ret);
+        return ub_parse_ts_collection(hFile, doc, ret);
     case UB_TST_POINTER:
-        return ub_parse_ts_pointer(hFile, ret);
+        return ub_parse_ts_pointer(hFile, doc, ret);
     case UB_TST_3B:
         return ub_parse_ts_3B(hFile, ret);
     }
 
 
-    return UB_MSG_FAILED_UNKNOWN;
+    return UB_ERRMSG(UB_SRC_TS, UB_MSG_INVALID_FORMAT);
 }
 
 int ub_parse_ts_prop(FILE* hFile, struct ub_ts_prop** ret) {
@@ -339,12 +475,12 @@ int ub_parse_ts_prop(FILE* hFile, struct ub_ts_prop** ret) {
     b2 = ub_byte(hFile);
     b3 = ub_byte(hFile);
     struct ts_prop_type*  prop_type_dat = ub_ts_prop_type_from_bin(b1, b2, b3);
+    struct ts_prop_type prop_type_fake = {0, 0, 0, ts_prop_guess_length(b1, b2, b3), NULL};
     if (prop_type_dat == NULL) {
         long pos = ftell(hFile);
 
-        struct ts_prop_type prop_type_fake = {0, 0, 0, ts_prop_guess_length(b1, b2, b3), NULL};
         prop_type_dat = &prop_type_fake;
-        printf("Warning: unknown property @0x%04X: (01 %02X %02X %02X) <%d> \n", pos, b1, b2, b3, prop_type_dat->len);
+        fprintf(stderr, "Warning: unknown property @0x%04X: (01 %02X %02X %02X) <%d> \n", pos, b1, b2, b3, prop_type_dat->len);
     }
 
     struct ub_ts_prop* prop = NULL;
@@ -363,13 +499,13 @@ int ub_parse_ts_prop(FILE* hFile, struct ub_ts_prop** ret) {
     prop->type_b1 = b1;
     prop->type_b2 = b2;
     prop->type_b3 = b3;
-    //prop->fpos = pos;
+    prop->fpos = pos;
 
     *ret = prop;
     return UB_OK;
 }
 
-int ub_parse_ts_node(FILE* hFile, struct ub_ts_node** ret) {
+int ub_parse_ts_node(FILE* hFile, struct ub_doc* doc, struct ub_ts_node** ret) {
     *ret = 0;
     long pos = ftell(hFile) - 1;
 
@@ -387,18 +523,24 @@ int ub_parse_ts_node(FILE* hFile, struct ub_ts_node** ret) {
     node->child_ptrs = node + 1;
     node->fpos = pos;
 
+    *ret = node;
     for (int i = 0; i < childCount; i++) {
         void* child_ptr = NULL;
-        long child_fpos = ftell(hFile);
-        int r = ub_parse_ts_tag(hFile, &child_ptr);
+        int r = ub_parse_ts_tag(hFile, doc, &child_ptr);
         node->child_ptrs[i] = child_ptr;
+        if (r != UB_OK) {
+            node->child_count = i + 1; // Only free what has been parsed
+            return r;
+        }
     }
 
-    *ret = node;
+    if (ftell(hFile) != pos + sizeInByte)
+        return UB_ERRMSG(UB_SRC_TS, UB_MSG_INVALID_LENGTH);
+
     return UB_OK;
 }
 
-int ub_parse_ts_collection(FILE* hFile, struct ub_ts_collection** ret) {
+int ub_parse_ts_collection(FILE* hFile, struct ub_doc* doc, struct ub_ts_collection** ret) {
     *ret = 0;
     long pos = ftell(hFile)-1;
 
@@ -414,38 +556,41 @@ int ub_parse_ts_collection(FILE* hFile, struct ub_ts_collection** ret) {
     coll->child_ptrs = coll + 1;
     coll->fpos = pos;
 
+    *ret = coll;
     for (int i = 0; i < count; i++) {
         struct ub_ts_node* child_ptr = NULL;
-        int r = ub_parse_ts_tag(hFile, &child_ptr);
-        // long pos2 = ftell(hFile);
+        int r = ub_parse_ts_tag(hFile, doc, &child_ptr);
         coll->child_ptrs[i] = child_ptr;
+        if (r != UB_OK) {
+            coll->child_count = i + 1;
+            return r;
+        }
     }
 
-    *ret = coll;
     return UB_OK;
 }
 
-int ub_parse_ts_pointer(FILE* hFile, struct ub_ts_pointer** ret) {
-    //long pos = ftell(hFile) - 1;
+int ub_parse_ts_pointer(FILE* hFile, struct ub_doc* doc, struct ub_ts_pointer** ret) {
+    long pos = ftell(hFile) - 1;
 
     struct ub_ts_pointer* node = malloc(sizeof(struct ub_ts_pointer));
     node->tag_type = UB_TST_POINTER;
     node->target_addr = ub_dword(hFile);
-    //node->fpos = pos;
-
-    ts_pointer_list[ts_pointer_list_count] = node;
-    ts_pointer_list_count++;
+    node->target_coll = NULL;
+    node->fpos = pos;
 
     *ret = node;
-    return UB_OK;
-}
+    // A pointer takes 5 bytes, so a valid binary can not have more, but a loop of pointers can
+    if (doc->pointer_count >= doc->size / 5)
+        return UB_ERRMSG(UB_SRC_TS, UB_MSG_INVALID_LENGTH);
 
-uint32_t ub_ts_pointer_count() {
-    return ts_pointer_list_count;
-}
+    if (doc->pointer_count == doc->pointer_capacity) {
+        doc->pointer_capacity = doc->pointer_capacity == 0 ? 16 : doc->pointer_capacity * 2;
+        doc->pointers = realloc(doc->pointers, sizeof(struct ub_ts_pointer*) * doc->pointer_capacity);
+    }
+    doc->pointers[doc->pointer_count++] = node;
 
-struct ub_ts_pointer* ub_ts_pointer_get(uint32_t id) {
-    return ts_pointer_list[id];
+    return UB_OK;
 }
 
 int ub_parse_ts_3B(FILE* hFile, struct ub_ts_3B** ret) {
@@ -466,4 +611,169 @@ int ub_parse_ts_3B(FILE* hFile, struct ub_ts_3B** ret) {
         return UB_ERRMSG(UB_SRC_TS, UB_MSG_INVALID_FORMAT);
 
     return UB_OK;
+}
+
+void ub_free_ts_tag(void* tag) {
+    if (tag == NULL)
+        return;
+
+    enum ub_ts_type tag_type = *((enum ub_ts_type*)tag);
+    if (tag_type == UB_TST_NODE) {
+        struct ub_ts_node* node = tag;
+        for (int i = 0; i < node->child_count; i++)
+            ub_free_ts_tag(node->child_ptrs[i]);
+    }
+    else if (tag_type == UB_TST_COLLECTION) {
+        struct ub_ts_collection* coll = tag;
+        for (int i = 0; i < coll->child_count; i++)
+            ub_free_ts_tag(coll->child_ptrs[i]);
+    }
+    else if (tag_type == UB_TST_POINTER) {
+        ub_free_ts_tag(((struct ub_ts_pointer*)tag)->target_coll);
+    }
+
+    free(tag);
+}
+
+static int ub_parse_ts(FILE* hFile, struct ub_doc* doc) {
+    doc->ts_fpos = ftell(hFile);
+    if (ub_byte(hFile) != 0x0D)
+        return UB_ERRMSG(UB_SRC_TS, UB_MSG_INVALID_HEADER);
+    if (ub_word(hFile) != 0x0003)
+        return UB_ERRMSG(UB_SRC_TS, UB_MSG_INVALID_FORMAT);
+    doc->ps_offset = ub_dword(hFile);
+
+    doc->pointer_count = 0;
+    int r = ub_parse_ts_tag(hFile, doc, &doc->root);
+    if (r != UB_OK)
+        return r;
+    if (doc->root == NULL || doc->root->tag_type != UB_TST_NODE)
+        return UB_ERRMSG(UB_SRC_TS, UB_MSG_INVALID_FORMAT);
+    doc->supp_fpos = ftell(hFile);
+
+    // Supplementary blocks may contain pointers as well, so the list can grow during this loop
+    for (uint32_t i = 0; i < doc->pointer_count; i++) {
+        struct ub_ts_pointer* pointer = doc->pointers[i];
+        if (fseek(hFile, pointer->target_addr, SEEK_SET) != 0)
+            return UB_ERRMSG(UB_SRC_TS, UB_MSG_INVALID_LENGTH);
+
+        uint16_t length = ub_word(hFile);
+        r = ub_parse_ts_tag(hFile, doc, &pointer->target_coll);
+        if (r != UB_OK)
+            return r;
+        if (ftell(hFile) != pointer->target_addr + length)
+            return UB_ERRMSG(UB_SRC_TS, UB_MSG_INVALID_LENGTH);
+    }
+
+    return UB_OK;
+}
+
+int ub_parse_doc(FILE* hFile, struct ub_doc** ret) {
+    *ret = 0;
+
+    if (!ub_check_header(hFile))
+        return UB_ERRMSG(UB_SRC_FILE, UB_MSG_INVALID_HEADER);
+
+    struct ub_doc* doc = calloc(1, sizeof(struct ub_doc));
+    doc->size = ub_dword(hFile);
+
+    int r = ub_parse_uss(hFile, &doc->uss);
+    if (r == UB_OK)
+        r = ub_parse_ac(hFile, &doc->ac);
+    if (r == UB_OK)
+        r = ub_parse_ss(hFile, &doc->ss);
+    if (r == UB_OK)
+        r = ub_parse_ts(hFile, doc);
+
+    if (r != UB_OK) {
+        ub_free_doc(doc);
+        return r;
+    }
+
+    *ret = doc;
+    return UB_OK;
+}
+
+int ub_reparse_doc(FILE* hFile, struct ub_doc* doc, const uint32_t* bounds, uint32_t changed) {
+    int r = UB_OK;
+
+    if (changed & (1 << UB_SECTION_HEADER)) {
+        if (fseek(hFile, 0, SEEK_SET) != 0 || !ub_check_header(hFile))
+            return UB_ERRMSG(UB_SRC_FILE, UB_MSG_INVALID_HEADER);
+        doc->size = ub_dword(hFile);
+    }
+
+    if (changed & (1 << UB_SECTION_USS)) {
+        struct ub_uss* uss;
+        if (fseek(hFile, bounds[UB_SECTION_USS], SEEK_SET) != 0)
+            return UB_ERRMSG(UB_SRC_USS, UB_MSG_INVALID_LENGTH);
+        r = ub_parse_uss(hFile, &uss);
+        if (r != UB_OK)
+            return r;
+        ub_free_uss(doc->uss);
+        doc->uss = uss;
+    }
+
+    if (changed & (1 << UB_SECTION_AC)) {
+        struct ub_ac* ac;
+        if (fseek(hFile, bounds[UB_SECTION_AC], SEEK_SET) != 0)
+            return UB_ERRMSG(UB_SRC_AC, UB_MSG_INVALID_LENGTH);
+        r = ub_parse_ac(hFile, &ac);
+        if (r != UB_OK)
+            return r;
+        ub_free_ac(doc->ac);
+        doc->ac = ac;
+    }
+
+    if (changed & (1 << UB_SECTION_SS)) {
+        struct ub_ss* ss;
+        if (fseek(hFile, bounds[UB_SECTION_SS], SEEK_SET) != 0)
+            return UB_ERRMSG(UB_SRC_SS, UB_MSG_INVALID_LENGTH);
+        r = ub_parse_ss(hFile, &ss);
+        if (r != UB_OK)
+            return r;
+        ub_free_ss(doc->ss);
+        doc->ss = ss;
+    }
+
+    if (changed & (1 << UB_SECTION_TS)) {
+        // Parse into a scratch doc, so that the old tree stays if the new one is broken
+        struct ub_doc ts = {0};
+        ts.size = doc->size;
+        if (fseek(hFile, bounds[UB_SECTION_TS], SEEK_SET) != 0)
+            return UB_ERRMSG(UB_SRC_TS, UB_MSG_INVALID_LENGTH);
+        r = ub_parse_ts(hFile, &ts);
+        if (r != UB_OK) {
+            ub_free_ts_tag(ts.root);
+            free(ts.pointers);
+            return r;
+        }
+
+        ub_free_ts_tag(doc->root);
+        free(doc->pointers);
+        doc->ts_fpos = ts.ts_fpos;
+        doc->ps_offset = ts.ps_offset;
+        doc->root = ts.root;
+        doc->supp_fpos = ts.supp_fpos;
+        doc->pointer_count = ts.pointer_count;
+        doc->pointer_capacity = ts.pointer_capacity;
+        doc->pointers = ts.pointers;
+    }
+
+    return UB_OK;
+}
+
+void ub_free_doc(struct ub_doc* doc) {
+    if (doc->uss != NULL)
+        ub_free_uss(doc->uss);
+    if (doc->ac != NULL)
+        ub_free_ac(doc->ac);
+    if (doc->ss != NULL)
+        ub_free_ss(doc->ss);
+
+    // The supplementary blocks are owned by the pointers within the tree
+    ub_free_ts_tag(doc->root);
+
+    free(doc->pointers);
+    free(doc);
 }
\ No newline at end of file
@@ -6,6 +6,7 @@
 
 struct ub_uss {
 	uint32_t length;
+	uint32_t fpos;
 	uint8_t count;
 	char** strings;
 };
@@ -25,6 +26,7 @@ struct ub_ac_pair {
 	enum ub_ac_property_type type;	// Byte
 	uint32_t value;
 	uint32_t auxdata;
+	uint32_t fpos;
 };
 
 enum ub_ac_property_type {
@@ -41,19 +43,24 @@ enum ub_object_type {
 	UBO_Gallery = 0x1500,
 	UBO_MenuGroup = 0x1800,
 	UBO_Tab = 0x1A00,
+	UBO_Ribbon = 0x2400,	// Root node of the Tree Section
 	UBO_QAT = 0x2500
 };
 
 struct ub_ss {
 	uint32_t length;
+	uint32_t fpos;
 	uint32_t count;
 	struct ub_ss_string** strings;
+	uint32_t index_mask;
+	uint32_t* index;			// Hash table of string ids, position in strings + 1, 0 if empty
 };
 
 struct ub_ss_string {
 	uint16_t id;
 	enum ub_object_type type;	// WORD
 	uint16_t length;
+	uint32_t fpos;
 	uint16_t* wchars;
 };
 
@@ -68,6 +75,7 @@ enum ub_ts_type {
 struct ub_ts_prop {
 	enum ub_ts_type tag_type;	// BYTE
 	uint8_t type_b1, type_b2, type_b3;
+	uint32_t fpos;
 	union payload
 	{
 		uint32_t data;
@@ -95,6 +103,7 @@ struct ub_ts_collection {
 struct ub_ts_pointer {
 	enum ub_ts_type tag_type;	// BYTE
 	uint32_t target_addr;
+	uint32_t fpos;
 	struct ub_ts_collection* target_coll;
 };
 
@@ -104,6 +113,192 @@ struct ub_ts_3B {
 	uint32_t data;
 };
 
+enum ub_stat_kind {
+	UB_STAT_AC = 1,			// b1 = ub_ac_property_type
+	UB_STAT_PROP,			// b1, b2, b3 = property type
+	UB_STAT_NODE,			// b1 | b2 << 8 = ub_object_type
+	UB_STAT_COLLECTION,		// b1 = collection type
+	UB_STAT_3B				// b1 = 0x3B type
+};
+
+struct ub_stat_entry {
+	uint8_t kind;				// enum ub_stat_kind, 0 if the slot is empty
+	uint8_t b1, b2, b3;
+	uint16_t parent_type;		// Object type of the enclosing node
+	uint32_t count;
+	uint32_t len_mask;			// Bit n is set if the enclosing node implies a payload of n bytes
+	uint32_t value_min, value_max;	// Payload, node length or number of children
+	uint32_t value_bits[33];	// Histogram of the number of significant bits of the value
+};
+
+struct ub_stats {	// Histograms over a corpus, one instance per thread
+	uint32_t capacity;			// Power of 2
+	uint32_t used;
+	uint32_t files;
+	uint32_t skipped;			// Files whose Tree Section can not be found
+	uint32_t invalid;			// Files walked although they failed the validation
+	struct ub_stat_entry* entries;
+};
+
+enum ub_col_table {
+	UB_TABLE_FILES,
+	UB_TABLE_COMMANDS,
+	UB_TABLE_STRINGS,
+	UB_TABLE_NODES,
+	UB_TABLE_PROPS,
+
+	ub_table_len	// Do not use
+};
+
+// Columns of the columnar export, in the order they are stored in the file.
+// file is the file id given to ub_columns_add, node ids are the row numbers within the nodes of the same file
+enum ub_col {
+	UB_COL_FILES_FILE,			// DWORD
+	UB_COL_FILES_SIZE,			// DWORD
+	UB_COL_FILES_VALID,			// BYTE, 0 if the file failed the validation and has no other rows
+	UB_COL_FILES_NAME_OFFSET,	// DWORD, rows + 1 entries, name of row i is [offset[i], offset[i + 1]) of FILES_NAME
+	UB_COL_FILES_NAME,			// UTF-8
+	UB_COL_COMMANDS_FILE,		// DWORD
+	UB_COL_COMMANDS_ID,			// WORD
+	UB_COL_COMMANDS_TYPE,		// BYTE, ub_ac_property_type
+	UB_COL_COMMANDS_VALUE,		// DWORD
+	UB_COL_COMMANDS_AUXDATA,	// WORD, 0 if the type has none
+	UB_COL_STRINGS_FILE,		// DWORD
+	UB_COL_STRINGS_ID,			// WORD
+	UB_COL_STRINGS_TYPE,		// WORD, ub_object_type
+	UB_COL_STRINGS_OFFSET,		// DWORD, rows + 1 entries
+	UB_COL_STRINGS_TEXT,		// UTF-8
+	UB_COL_NODES_FILE,			// DWORD
+	UB_COL_NODES_PARENT,		// DWORD, 0xFFFFFFFF for the root, nodes in a supplementary block belong to the node holding the pointer
+	UB_COL_NODES_TYPE,			// WORD, ub_object_type
+	UB_COL_NODES_LENGTH,		// WORD
+	UB_COL_NODES_FPOS,			// DWORD
+	UB_COL_NODES_DEPTH,			// BYTE
+	UB_COL_PROPS_FILE,			// DWORD
+	UB_COL_PROPS_NODE,			// DWORD
+	UB_COL_PROPS_B1,			// BYTE
+	UB_COL_PROPS_B2,			// BYTE
+	UB_COL_PROPS_B3,			// BYTE
+	UB_COL_PROPS_VALUE,			// DWORD, the first 4 bytes of a longer payload
+
+	ub_col_len	// Do not use
+};
+
+struct ub_column {
+	uint32_t size;				// In bytes
+	uint32_t capacity;
+	uint8_t* data;
+};
+
+struct ub_columns {	// Rows collected by one thread
+	uint32_t rows[ub_table_len];
+	struct ub_column cols[ub_col_len];
+};
+
+struct ub_columns_view {	// Points into a loaded export, nothing is copied
+	uint32_t rows[ub_table_len];
+	uint32_t sizes[ub_col_len];	// In bytes
+	const void* cols[ub_col_len];	// 8-byte aligned if the export is
+};
+
+enum ub_query_test {
+	UB_QTEST_ANY,				// *, a node or a collection
+	UB_QTEST_NODE,				// Node
+	UB_QTEST_NODE_TYPE,			// 0x0F00, ...
+	UB_QTEST_COLLECTION,		// Collection
+	UB_QTEST_ELEMENT			// Button, Group, ..., a node type with an element name in the Ribbon markup
+};
+
+enum ub_query_key {
+	UB_QKEY_PROP,				// @b1b2b3, the first 4 bytes of the payload
+	UB_QKEY_PROP_ANY_LEN,		// @b1b2, b3 only encodes the length of some properties
+	UB_QKEY_TYPE,				// Object type of a node, type byte of a collection
+	UB_QKEY_COUNT,				// Number of child tags
+	UB_QKEY_ID,					// Referring Id
+	UB_QKEY_NAME				// String of the Referring Id in the String Section
+};
+
+enum ub_query_op {
+	UB_QOP_EXISTS,
+	UB_QOP_EQ,
+	UB_QOP_NE,
+	UB_QOP_LT,
+	UB_QOP_GT,
+	UB_QOP_LE,
+	UB_QOP_GE
+};
+
+#define UB_QUERY_MAX_PREDS 4
+
+struct ub_query_pred {
+	uint8_t key;				// ub_query_key
+	uint8_t op;					// ub_query_op
+	uint8_t b1, b2, b3;
+	uint32_t value;
+	uint16_t name_len;			// In bytes
+	uint8_t* name;				// UTF-16LE
+};
+
+struct ub_query_step {
+	uint32_t query;				// Index of the query the step belongs to
+	uint8_t descendant;			// Axis, 0 for / and 1 for //
+	uint8_t last;				// The query matches if the last step does
+	uint8_t test;				// ub_query_test
+	uint16_t type;
+	int pred_count;
+	struct ub_query_pred preds[UB_QUERY_MAX_PREDS];
+};
+
+struct ub_query_set {	// Compiled queries, read-only while running
+	uint32_t query_count;
+	uint32_t step_count;
+	uint32_t step_capacity;
+	uint8_t has_names;
+	struct ub_query_step* steps;	// Steps of all queries in order, step i is bit i of a state set
+};
+
+// Corrupted binaries must not overflow the stack, pointers can also form a loop.
+// ub_walk calls enter and pointer with a depth up to UB_TS_MAX_DEPTH, leaf up to UB_TS_MAX_DEPTH + 1
+#define UB_TS_MAX_DEPTH 64
+
+struct ub_visitor {	// Callbacks of ub_walk, each can be NULL
+	void (*command)(void* ctx, const uint8_t* data, uint32_t pos, uint16_t id);	// An AC pair, pos is its type byte
+	int (*enter)(void* ctx, const uint8_t* data, uint32_t pos, int depth);		// A node or a collection, return 0 to skip its children
+	void (*leaf)(void* ctx, const uint8_t* data, uint32_t pos, int len, int depth);	// A property or a 0x3B tag, see ub_walk for len
+	int (*pointer)(void* ctx, const uint8_t* data, uint32_t pos, int depth);	// Return non-zero to walk the supplementary block at depth + 1
+	void* ctx;
+};
+
+struct ub_buf {	// A whole binary loaded in memory, for editing
+	uint32_t size;
+	uint32_t capacity;
+	uint8_t* data;
+};
+
+struct ub_doc {	// A whole parsed binary
+	uint32_t size;				// File size from the header
+	struct ub_uss* uss;
+	struct ub_ac* ac;
+	struct ub_ss* ss;
+	uint32_t ts_fpos;
+	uint32_t ps_offset;			// Absolute address of the pointer section
+	struct ub_ts_node* root;
+	uint32_t supp_fpos;			// Length DWORD of the supplementary block section
+	uint32_t pointer_count;
+	uint32_t pointer_capacity;
+	struct ub_ts_pointer** pointers;	// target_coll holds the supplementary block
+};
+
+enum ub_section {
+	UB_SECTION_HEADER,
+	UB_SECTION_USS,
+	UB_SECTION_AC,
+	UB_SECTION_SS,
+	UB_SECTION_TS,				// Including the supplementary blocks and the Pointer Section
+
+	ub_section_len	// Do not use
+};
+
 enum ub_src {
 	UB_SRC_UNKNOWN,
 	UB_SRC_FILE,
@@ -130,38 +325,134 @@ enum ub_err {
 #define UB_FAILED UB_ERRMSG(UB_SRC_UNKNOWN, UB_MSG_FAILED_UNKNOWN)
 #define UB_ERRMSG(src, msg) (((src&0xFF)<<24) | (msg&0xFFFF))
 #define UB_ERRMSG_SRC(errmsg) ((enum ub_src) ((errmsg>>24)&0xFF))
-#define UB_ERRMSG_MSG(errmsg) ((enum ub_err) (msg&0xFFFF))
+#define UB_ERRMSG_MSG(errmsg) ((enum ub_err) (errmsg&0xFFFF))
 
 
 // fp stands for file pointer
 
 // Check the header magic number and fp+=14
 int ub_check_header(FILE* file);
+int ub_check_header_buf(const uint8_t* data, uint32_t size);
 
 // Read a BYTE/WORD/DWORD and fp+=1/2/4
 uint8_t ub_byte(FILE* hFile);
 uint16_t ub_word(FILE* hFile);
 uint32_t ub_dword(FILE* hFile);
 
+// Read a little-endian WORD/DWORD from memory
+uint16_t ub_buf_word(const uint8_t* ptr);
+uint32_t ub_buf_dword(const uint8_t* ptr);
+
+// Decode the code point at ptr, a little-endian UTF-16 string with count WideChars left, unpaired surrogates
+// become U+FFFD. Returns the number of WideChars used
+int ub_utf16_get(const uint8_t* ptr, uint32_t count, uint32_t* c);
+// Encode a code point as UTF-8 into out, which has room for 4 bytes. Returns the number of bytes written
+int ub_utf8_put(uint32_t c, uint8_t* out);
+
 int ub_parse_uss(FILE* hFile, struct ub_uss** ret);
 void ub_free_uss(struct ub_uss* uss);
 
 int ub_parse_ac(FILE* hFile, struct ub_ac** ret);
+int ub_ac_prop_len(enum ub_ac_property_type type);	// -1 if unknown
 char* ub_prop_type_str(enum ub_ac_property_type type);
 void ub_free_ac(struct ub_ac* ac);
 
 int ub_parse_ss(FILE* hFile, struct ub_ss** ret);
+struct ub_ss_string* ub_ss_find(struct ub_ss* ss, uint16_t id);	// NULL if not found, O(1)
 const uint16_t* ub_ss_get(struct ub_ss* ss, uint16_t id);
+uint32_t ub_ss_hash(uint16_t id);	// Slot of a string id in a hash table of a power of 2 size, before masking
 const char* ub_obj_type_str(enum ub_object_type type);
+const char* ub_obj_type_element(enum ub_object_type type);	// Element name in the Ribbon markup, NULL if it has none
+int ub_obj_type_from_element(const char* name, size_t len);	// -1 if name is not an element of the Ribbon markup
 void ub_free_ss(struct ub_ss* ss);
 
-int ub_parse_ts_tag(FILE* hFile, void** ret);
+// Pointers are appended to doc->pointers, the supplementary blocks are parsed by ub_parse_doc
+int ub_parse_ts_tag(FILE* hFile, struct ub_doc* doc, void** ret);
 int ub_parse_ts_prop(FILE* hFile, struct ub_ts_prop** ret);
-int ub_parse_ts_node(FILE* hFile, struct ub_ts_node** ret);
-int ub_parse_ts_collection(FILE* hFile, struct ub_ts_collection** ret);
-int ub_parse_ts_pointer(FILE* hFile, struct ub_ts_pointer** ret);
+int ub_parse_ts_node(FILE* hFile, struct ub_doc* doc, struct ub_ts_node** ret);
+int ub_parse_ts_collection(FILE* hFile, struct ub_doc* doc, struct ub_ts_collection** ret);
+int ub_parse_ts_pointer(FILE* hFile, struct ub_doc* doc, struct ub_ts_pointer** ret);
 int ub_parse_ts_3B(FILE* hFile, struct ub_ts_3B** ret);
 
 int ub_ts_prop_len(struct ub_ts_prop*);
+int ub_ts_prop_len_from_bin(uint8_t b1, uint8_t b2, uint8_t b3);	// Same length as the parser reads
 const char* ub_ts_prop_name_str(struct ub_ts_prop*);
+void ub_free_ts_tag(void* tag);
+
+// Parse the whole binary, fp must point to the header
+int ub_parse_doc(FILE* hFile, struct ub_doc** ret);
+// Parse the sections with their bit (1 << ub_section) set in changed again, at the offsets in bounds.
+// A section is replaced only if it is parsed successfully
+int ub_reparse_doc(FILE* hFile, struct ub_doc* doc, const uint32_t* bounds, uint32_t changed);
+void ub_free_doc(struct ub_doc* doc);
+
+// Editing, buf and doc must come from the same binary
+int ub_buf_load(FILE* hFile, struct ub_buf** ret);
+int ub_buf_save(struct ub_buf* buf, FILE* hFile);
+void ub_free_buf(struct ub_buf* buf);
+
+// Same-size edits, only the payload bytes are rewritten
+int ub_patch_ac_pair(struct ub_buf* buf, struct ub_ac_pair* pair, uint32_t value, uint32_t auxdata);
+int ub_patch_ts_prop(struct ub_buf* buf, struct ub_ts_prop* prop, uint32_t data);	// Fails if data does not fit in the payload
+
+// Replace old_len bytes at offset with new_len bytes of data, then fix up the enclosing lengths,
+// the file size, ps_offset and every address behind the edit point, in both buf and doc.
+// Fails if the range cuts through a node, collection or supplementary block. Walks the tree and moves the tail
+int ub_splice(struct ub_buf* buf, struct ub_doc* doc, uint32_t offset, uint32_t old_len, const void* data, uint32_t new_len);
+// length is in bytes, same as ub_ss_string
+int ub_patch_ss_string(struct ub_buf* buf, struct ub_doc* doc, uint32_t index, const uint16_t* wchars, uint16_t length);
+
+// Check every section, length, count and address of a whole binary in memory, in one pass. The pointers and
+// supplementary blocks are kept on the stack, only a binary with more than 64 of them allocates.
+// report (can be NULL) is called for every inconsistency, returns the number of inconsistencies.
+// Running out of memory counts as one, so that the binary is not taken as valid
+uint32_t ub_validate(const uint8_t* data, uint32_t size,
+	void (*report)(void* ctx, uint32_t fpos, int err, const char* desc), void* ctx);
+// Section i is [bounds[i], bounds[i + 1]), bounds has ub_section_len + 1 entries. Returns 0 if the sections run past size
+int ub_section_bounds(const uint8_t* data, uint32_t size, uint32_t* bounds);
+// Walk the AC pairs and the Tree Section of a binary in memory without parsing it, with a pointer walking its
+// supplementary block in place. Every tag is bounds checked, a node holding a broken child is skipped by its length.
+// len of leaf is the payload length the enclosing node implies: its children fill it, the last one taking the rest
+// if it is a property. It is -1 if they do not, the tag is then stepped over by the length from ub_ts_prop_len_from_bin
+int ub_walk(const uint8_t* data, uint32_t size, const struct ub_visitor* visitor);
+// Position right behind the tag at pos, or 0 if it is unknown or runs past limit
+uint32_t ub_ts_tag_end(const uint8_t* data, uint32_t pos, uint32_t limit);
+// First 4 bytes of a payload of len bytes
+uint32_t ub_ts_payload(const uint8_t* ptr, int len);
+
+// Corpus statistics, ub_stats_add only reads the binary and is safe to call from multiple threads on different ub_stats.
+// bounds are the section bounds of a binary which already passed ub_validate, NULL to validate it here
+struct ub_stats* ub_new_stats(void);
+int ub_stats_add(struct ub_stats* stats, const uint8_t* data, uint32_t size, const uint32_t* bounds);
+void ub_stats_merge(struct ub_stats* dst, const struct ub_stats* src);
+void ub_free_stats(struct ub_stats* stats);
+
+// Write the Ribbon markup the binary was compiled from, in one pass over doc.
+// Unknown nodes, collections and properties are written as comments
+int ub_write_xaml(struct ub_doc* doc, FILE* out);
+
+// Columnar export, ub_columns_add only reads the binary and is safe to call from multiple threads on different ub_columns.
+// ub_columns_write concatenates the batches, ub_columns_map checks an export in memory and points view into it
+struct ub_columns* ub_new_columns(void);
+int ub_columns_add(struct ub_columns* cols, uint32_t file, const char* name, const uint8_t* data, uint32_t size);
+int ub_columns_write(struct ub_columns** batches, int batch_count, FILE* out);
+int ub_columns_map(const uint8_t* data, size_t size, struct ub_columns_view* view);
+void ub_free_columns(struct ub_columns* cols);
+
+// Find the binaries embedded in an arbitrary image, whose header starts within [start, end).
+// A binary may extend past end, so the image can be split among threads. found (can be NULL) is called
+// for every binary which passes ub_validate, with its section bounds. Returns the number of binaries found
+size_t ub_carve(const uint8_t* data, size_t size, size_t start, size_t end,
+	void (*found)(void* ctx, size_t offset, uint32_t bin_size, const uint32_t* bounds), void* ctx);
+
+// Path queries, see the readme for the syntax. Every query added to a set is evaluated in the same pass
+// of ub_query_run, which walks the binary in memory and skips the subtrees no query can match in.
+// ub_query_add sets err_pos (can be NULL) to the offset of a syntax error, match is called
+// with the index of the query and the position of the matching node or collection. bounds are those of a binary
+// which already passed ub_validate, NULL to validate it here
+struct ub_query_set* ub_new_query_set(void);
+int ub_query_add(struct ub_query_set* set, const char* query, uint32_t* err_pos);
+int ub_query_run(const struct ub_query_set* set, const uint8_t* data, uint32_t size, const uint32_t* bounds,
+	void (*match)(void* ctx, uint32_t query, uint32_t fpos), void* ctx);
+void ub_free_query_set(struct ub_query_set* set);
 #endif
\ No newline at end of file
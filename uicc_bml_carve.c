@@ -0,0 +1,48 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "uicc_bml.h"
+
+// "SCBin" at the end of the header magic number is rare in arbitrary data, unlike its leading zeros
+#define MAGIC_TAIL_OFFSET 9
+#define HEADER_LEN 18
+
+size_t ub_carve(const uint8_t* data, size_t size, size_t start, size_t end,
+    void (*found)(void* ctx, size_t offset, uint32_t bin_size, const uint32_t* bounds), void* ctx) {
+    size_t count = 0;
+
+    if (end > size)
+        end = size;
+    if (start >= end || size < HEADER_LEN)
+        return 0;
+
+    // Look for the 'S' of the tail with memchr, which is vectorized by the C runtime
+    const uint8_t* scan = data + start + MAGIC_TAIL_OFFSET;
+    const uint8_t* scan_end = data + (end + MAGIC_TAIL_OFFSET < size ? end + MAGIC_TAIL_OFFSET : size);
+    while (scan < scan_end) {
+        const uint8_t* hit = memchr(scan, 'S', scan_end - scan);
+        if (hit == NULL)
+            break;
+        scan = hit + 1;
+
+        size_t offset = hit - data - MAGIC_TAIL_OFFSET;
+        if (offset + HEADER_LEN > size || !ub_check_header_buf(data + offset, HEADER_LEN))
+            continue;
+
+        // The file size DWORD must fit in the image, then the whole binary must be consistent
+        uint32_t bin_size = ub_buf_dword(data + offset + 14);
+        if (bin_size < HEADER_LEN || bin_size > size - offset)
+            continue;
+        uint32_t bounds[ub_section_len + 1];
+        if (ub_validate(data + offset, bin_size, NULL, NULL) != 0 || !ub_section_bounds(data + offset, bin_size, bounds))
+            continue;
+
+        // The consumers take the bounds as proof of the validation, and do not validate again
+        count++;
+        if (found != NULL)
+            found(ctx, offset, bin_size, bounds);
+    }
+
+    return count;
+}
@@ -0,0 +1,320 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "uicc_bml.h"
+
+// "UBCOLS" and a WORD version
+static const uint8_t columns_magic[] = {0x55, 0x42, 0x43, 0x4F, 0x4C, 0x53, 0x01, 0x00};
+
+enum col_kind {
+    COL_FIXED,      // One value of width bytes per row
+    COL_OFFSET,     // DWORD offsets into the next column, one more than rows
+    COL_BLOB        // Bytes indexed by the previous column
+};
+
+static const struct col_spec {
+    enum ub_col_table table;
+    enum col_kind kind;
+    uint8_t width;
+} col_specs[ub_col_len] = {
+    {UB_TABLE_FILES, COL_FIXED, 4},
+    {UB_TABLE_FILES, COL_FIXED, 4},
+    {UB_TABLE_FILES, COL_FIXED, 1},
+    {UB_TABLE_FILES, COL_OFFSET, 4},
+    {UB_TABLE_FILES, COL_BLOB, 1},
+    {UB_TABLE_COMMANDS, COL_FIXED, 4},
+    {UB_TABLE_COMMANDS, COL_FIXED, 2},
+    {UB_TABLE_COMMANDS, COL_FIXED, 1},
+    {UB_TABLE_COMMANDS, COL_FIXED, 4},
+    {UB_TABLE_COMMANDS, COL_FIXED, 2},
+    {UB_TABLE_STRINGS, COL_FIXED, 4},
+    {UB_TABLE_STRINGS, COL_FIXED, 2},
+    {UB_TABLE_STRINGS, COL_FIXED, 2},
+    {UB_TABLE_STRINGS, COL_OFFSET, 4},
+    {UB_TABLE_STRINGS, COL_BLOB, 1},
+    {UB_TABLE_NODES, COL_FIXED, 4},
+    {UB_TABLE_NODES, COL_FIXED, 4},
+    {UB_TABLE_NODES, COL_FIXED, 2},
+    {UB_TABLE_NODES, COL_FIXED, 2},
+    {UB_TABLE_NODES, COL_FIXED, 4},
+    {UB_TABLE_NODES, COL_FIXED, 1},
+    {UB_TABLE_PROPS, COL_FIXED, 4},
+    {UB_TABLE_PROPS, COL_FIXED, 4},
+    {UB_TABLE_PROPS, COL_FIXED, 1},
+    {UB_TABLE_PROPS, COL_FIXED, 1},
+    {UB_TABLE_PROPS, COL_FIXED, 1},
+    {UB_TABLE_PROPS, COL_FIXED, 4}
+};
+
+// Magic number, DWORD table count, DWORD column count, then the rows of each table and the size of each column
+#define HEADER_LEN (sizeof(columns_magic) + 8 + 4 * ub_table_len + 4 * ub_col_len)
+// Every column starts on an 8-byte boundary
+#define ALIGN8(x) (((x) + 7) & ~(size_t)7)
+
+static uint8_t* col_reserve(struct ub_column* col, uint32_t len) {
+    if (col->size + len > col->capacity) {
+        uint32_t capacity = col->capacity == 0 ? 256 : col->capacity;
+        while (capacity < col->size + len)
+            capacity *= 2;
+        col->data = realloc(col->data, capacity);
+        col->capacity = capacity;
+    }
+    return col->data + col->size;
+}
+
+static void col_put(struct ub_column* col, const void* src, uint32_t len) {
+    if (len == 0)
+        return;
+    memcpy(col_reserve(col, len), src, len);
+    col->size += len;
+}
+
+static void col_put_byte(struct ub_columns* cols, enum ub_col col, uint8_t value) {
+    col_put(cols->cols + col, &value, 1);
+}
+
+static void col_put_word(struct ub_columns* cols, enum ub_col col, uint16_t value) {
+    col_put(cols->cols + col, &value, 2);
+}
+
+static void col_put_dword(struct ub_columns* cols, enum ub_col col, uint32_t value) {
+    col_put(cols->cols + col, &value, 4);
+}
+
+// Little-endian UTF-16 to UTF-8
+static void col_put_utf8(struct ub_column* col, const uint8_t* ptr, uint32_t lenwchar) {
+    uint32_t count = lenwchar >> 1;
+    uint8_t* out = col_reserve(col, count * 3);
+    uint8_t* start = out;
+
+    for (uint32_t i = 0; i < count;) {
+        uint32_t c;
+        i += ub_utf16_get(ptr + i * 2, count - i, &c);
+        out += ub_utf8_put(c, out);
+    }
+
+    col->size += (uint32_t)(out - start);
+}
+
+struct col_walker {
+    struct ub_columns* cols;
+    uint32_t file;
+    uint32_t node_base;     // Row of the first node of this file
+    uint32_t parents[UB_TS_MAX_DEPTH + 2];      // Node enclosing each depth, relative to node_base
+    uint8_t node_depths[UB_TS_MAX_DEPTH + 2];   // Number of nodes enclosing each depth
+};
+
+static void col_command(void* ctx, const uint8_t* data, uint32_t pos, uint16_t id) {
+    struct col_walker* w = ctx;
+    struct ub_columns* cols = w->cols;
+    uint8_t type = data[pos];
+    int len = ub_ac_prop_len(type);
+
+    col_put_dword(cols, UB_COL_COMMANDS_FILE, w->file);
+    col_put_word(cols, UB_COL_COMMANDS_ID, id);
+    col_put_byte(cols, UB_COL_COMMANDS_TYPE, type);
+    col_put_dword(cols, UB_COL_COMMANDS_VALUE, ub_buf_dword(data + pos + 1));
+    col_put_word(cols, UB_COL_COMMANDS_AUXDATA, len == 6 ? ub_buf_word(data + pos + 5) : 0);
+    cols->rows[UB_TABLE_COMMANDS]++;
+}
+
+static int col_enter(void* ctx, const uint8_t* data, uint32_t pos, int depth) {
+    struct col_walker* w = ctx;
+    struct ub_columns* cols = w->cols;
+
+    // The children of a collection belong to the enclosing node
+    if (data[pos] != UB_TST_NODE) {
+        w->parents[depth + 1] = w->parents[depth];
+        w->node_depths[depth + 1] = w->node_depths[depth];
+        return 1;
+    }
+
+    col_put_dword(cols, UB_COL_NODES_FILE, w->file);
+    col_put_dword(cols, UB_COL_NODES_PARENT, w->parents[depth]);
+    col_put_word(cols, UB_COL_NODES_TYPE, ub_buf_word(data + pos + 1));
+    col_put_word(cols, UB_COL_NODES_LENGTH, ub_buf_word(data + pos + 5));
+    col_put_dword(cols, UB_COL_NODES_FPOS, pos);
+    col_put_byte(cols, UB_COL_NODES_DEPTH, w->node_depths[depth]);
+    w->parents[depth + 1] = cols->rows[UB_TABLE_NODES] - w->node_base;
+    w->node_depths[depth + 1] = w->node_depths[depth] + 1;
+    cols->rows[UB_TABLE_NODES]++;
+    return 1;
+}
+
+static void col_leaf(void* ctx, const uint8_t* data, uint32_t pos, int len, int depth) {
+    struct col_walker* w = ctx;
+    struct ub_columns* cols = w->cols;
+
+    if (data[pos] != UB_TST_PROP)
+        return;
+    col_put_dword(cols, UB_COL_PROPS_FILE, w->file);
+    col_put_dword(cols, UB_COL_PROPS_NODE, w->parents[depth]);
+    col_put_byte(cols, UB_COL_PROPS_B1, data[pos + 1]);
+    col_put_byte(cols, UB_COL_PROPS_B2, data[pos + 2]);
+    col_put_byte(cols, UB_COL_PROPS_B3, data[pos + 3]);
+    col_put_dword(cols, UB_COL_PROPS_VALUE, ub_ts_payload(data + pos + 4, len));
+    cols->rows[UB_TABLE_PROPS]++;
+}
+
+// The supplementary block belongs to the node holding the pointer
+static int col_pointer(void* ctx, const uint8_t* data, uint32_t pos, int depth) {
+    struct col_walker* w = ctx;
+    w->parents[depth + 1] = w->parents[depth];
+    w->node_depths[depth + 1] = w->node_depths[depth];
+    return 1;
+}
+
+struct ub_columns* ub_new_columns(void) {
+    return calloc(1, sizeof(struct ub_columns));
+}
+
+int ub_columns_add(struct ub_columns* cols, uint32_t file, const char* name, const uint8_t* data, uint32_t size) {
+    int valid = data != NULL && ub_validate(data, size, NULL, NULL) == 0;
+
+    uint32_t name_len = (uint32_t)strlen(name);
+    col_put_dword(cols, UB_COL_FILES_FILE, file);
+    col_put_dword(cols, UB_COL_FILES_SIZE, size);
+    col_put_byte(cols, UB_COL_FILES_VALID, valid);
+    col_put_dword(cols, UB_COL_FILES_NAME_OFFSET, cols->cols[UB_COL_FILES_NAME].size);
+    col_put(cols->cols + UB_COL_FILES_NAME, name, name_len);
+    cols->rows[UB_TABLE_FILES]++;
+
+    if (!valid)
+        return UB_ERRMSG(UB_SRC_FILE, UB_MSG_INVALID_FORMAT);
+
+    uint32_t bounds[ub_section_len + 1];
+    ub_section_bounds(data, size, bounds);
+    uint32_t count = ub_buf_dword(data + bounds[UB_SECTION_SS] + 5);
+    uint32_t pos = bounds[UB_SECTION_SS] + 9;
+    for (uint32_t i = 0; i < count; i++) {
+        uint16_t lenwchar = ub_buf_word(data + pos + 8);
+        col_put_dword(cols, UB_COL_STRINGS_FILE, file);
+        col_put_word(cols, UB_COL_STRINGS_ID, ub_buf_word(data + pos));
+        col_put_word(cols, UB_COL_STRINGS_TYPE, ub_buf_word(data + pos + 4));
+        col_put_dword(cols, UB_COL_STRINGS_OFFSET, cols->cols[UB_COL_STRINGS_TEXT].size);
+        col_put_utf8(cols->cols + UB_COL_STRINGS_TEXT, data + pos + 10, lenwchar);
+        cols->rows[UB_TABLE_STRINGS]++;
+        pos += 10 + lenwchar;
+    }
+
+    struct col_walker w = {cols, file, cols->rows[UB_TABLE_NODES]};
+    w.parents[0] = 0xFFFFFFFF;
+    struct ub_visitor visitor = {col_command, col_enter, col_leaf, col_pointer, &w};
+    ub_walk(data, size, &visitor);
+
+    return UB_OK;
+}
+
+static int col_write_padding(FILE* out, size_t len) {
+    static const uint8_t zeros[8] = {0};
+    return fwrite(zeros, 1, ALIGN8(len) - len, out) == ALIGN8(len) - len;
+}
+
+int ub_columns_write(struct ub_columns** batches, int batch_count, FILE* out) {
+    uint32_t header[2 + ub_table_len + ub_col_len] = {ub_table_len, ub_col_len};
+    uint32_t* rows = header + 2;
+    uint32_t* sizes = rows + ub_table_len;
+
+    for (int i = 0; i < batch_count; i++) {
+        for (int t = 0; t < ub_table_len; t++)
+            rows[t] += batches[i]->rows[t];
+        for (int c = 0; c < ub_col_len; c++)
+            sizes[c] += batches[i]->cols[c].size;
+    }
+    for (int c = 0; c < ub_col_len; c++) {
+        if (col_specs[c].kind == COL_OFFSET)
+            sizes[c] = (rows[col_specs[c].table] + 1) * 4;
+    }
+
+    if (fwrite(columns_magic, 1, sizeof(columns_magic), out) != sizeof(columns_magic) ||
+        fwrite(header, 1, sizeof(header), out) != sizeof(header) || !col_write_padding(out, HEADER_LEN))
+        return UB_ERRMSG(UB_SRC_FILE, UB_MSG_FAILED_UNKNOWN);
+
+    for (int c = 0; c < ub_col_len; c++) {
+        if (col_specs[c].kind != COL_OFFSET) {
+            for (int i = 0; i < batch_count; i++) {
+                struct ub_column* col = batches[i]->cols + c;
+                if (col->size != 0 && fwrite(col->data, 1, col->size, out) != col->size)
+                    return UB_ERRMSG(UB_SRC_FILE, UB_MSG_FAILED_UNKNOWN);
+            }
+        }
+        else {
+            // Offsets are relative to the blob of each batch, move them behind the previous batches
+            uint32_t base = 0;
+            uint32_t chunk[256];
+            for (int i = 0; i < batch_count; i++) {
+                struct ub_column* col = batches[i]->cols + c;
+                const uint32_t* offsets = (const uint32_t*)col->data;
+                uint32_t count = col->size / 4;
+                for (uint32_t j = 0; j < count; j += 256) {
+                    uint32_t n = count - j < 256 ? count - j : 256;
+                    for (uint32_t k = 0; k < n; k++)
+                        chunk[k] = offsets[j + k] + base;
+                    if (fwrite(chunk, 4, n, out) != n)
+                        return UB_ERRMSG(UB_SRC_FILE, UB_MSG_FAILED_UNKNOWN);
+                }
+                base += batches[i]->cols[c + 1].size;
+            }
+            if (fwrite(&base, 4, 1, out) != 1)
+                return UB_ERRMSG(UB_SRC_FILE, UB_MSG_FAILED_UNKNOWN);
+        }
+
+        if (!col_write_padding(out, sizes[c]))
+            return UB_ERRMSG(UB_SRC_FILE, UB_MSG_FAILED_UNKNOWN);
+    }
+
+    return UB_OK;
+}
+
+int ub_columns_map(const uint8_t* data, size_t size, struct ub_columns_view* view) {
+    if (size < HEADER_LEN || memcmp(data, columns_magic, sizeof(columns_magic)) != 0)
+        return UB_ERRMSG(UB_SRC_FILE, UB_MSG_INVALID_HEADER);
+
+    const uint8_t* ptr = data + sizeof(columns_magic);
+    if (ub_buf_dword(ptr) != ub_table_len || ub_buf_dword(ptr + 4) != ub_col_len)
+        return UB_ERRMSG(UB_SRC_FILE, UB_MSG_INVALID_FORMAT);
+    ptr += 8;
+    for (int t = 0; t < ub_table_len; t++, ptr += 4)
+        view->rows[t] = ub_buf_dword(ptr);
+    for (int c = 0; c < ub_col_len; c++, ptr += 4)
+        view->sizes[c] = ub_buf_dword(ptr);
+
+    size_t pos = ALIGN8(HEADER_LEN);
+    for (int c = 0; c < ub_col_len; c++) {
+        const struct col_spec* spec = col_specs + c;
+        uint64_t rows = view->rows[spec->table];
+        if ((spec->kind == COL_FIXED && view->sizes[c] != rows * spec->width) ||
+            (spec->kind == COL_OFFSET && view->sizes[c] != (rows + 1) * 4) ||
+            view->sizes[c] > size - pos)
+            return UB_ERRMSG(UB_SRC_FILE, UB_MSG_INVALID_LENGTH);
+
+        view->cols[c] = data + pos;
+        pos += view->sizes[c];
+        pos = ALIGN8(pos) < size ? ALIGN8(pos) : size;
+    }
+
+    // Every offset has to stay within its blob
+    for (int c = 0; c < ub_col_len; c++) {
+        if (col_specs[c].kind != COL_OFFSET)
+            continue;
+        const uint8_t* offsets = view->cols[c];
+        uint32_t prev = 0;
+        for (uint32_t i = 0; i < view->sizes[c] / 4; i++) {
+            uint32_t offset = ub_buf_dword(offsets + i * 4);
+            if (offset < prev || offset > view->sizes[c + 1])
+                return UB_ERRMSG(UB_SRC_FILE, UB_MSG_INVALID_LENGTH);
+            prev = offset;
+        }
+        if (prev != view->sizes[c + 1])
+            return UB_ERRMSG(UB_SRC_FILE, UB_MSG_INVALID_LENGTH);
+    }
+
+    return UB_OK;
+}
+
+void ub_free_columns(struct ub_columns* cols) {
+    for (int c = 0; c < ub_col_len; c++)
+        free(cols->cols[c].data);
+    free(cols);
+}
@@ -1,5 +1,10 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/stat.h>
 #include <Windows.h>
 
 #include "uicc_bml.h"
@@ -12,11 +17,9 @@ if (start && level>0) printf("|--"); \
 printf(__VA_ARGS__); \
 }
 
-extern uint32_t ub_ts_pointer_count();
-extern struct ub_ts_pointer* ub_ts_pointer_get(uint32_t id);
-
 void print_ts_coll(struct ub_ts_collection* coll, int level);
 void print_ts_node(struct ub_ts_node* node, int level);
+int worker_count(int max_count);
 
 void print_ts_coll(struct ub_ts_collection* coll, int level) {
     printl(1, level, "Collection: type = 0x%02X (%d), @0x%0X, %d children\n", coll->type, coll->type, coll->fpos, coll->child_count);
@@ -99,18 +102,12 @@ void print_ts_node(struct ub_ts_node* node, int level) {
     printl(0, level, "}\n");
 }
 
-void parse(FILE* hFile) {
-    int header_valid = ub_check_header(hFile);
-    if (!header_valid)
-        printf("FILE - Invalid header!");
-
-    uint32_t lenFile = ub_dword(hFile);
-    printf("Size of the file: %d \n", lenFile);
+void print_header(struct ub_doc* doc) {
+    printf("Size of the file: %d \n", doc->size);
     printf("\n");
+}
 
-
-    struct ub_uss* uss;
-    int r = ub_parse_uss(hFile, &uss);
+void print_uss(struct ub_uss* uss) {
     printf("# Parsing the Unknown String section\n");
     printf("length = %d\n", uss->length);
     printf("count = %d\n", uss->count);
@@ -118,14 +115,9 @@ void parse(FILE* hFile) {
         printf("%d = %s\n", i+1, uss->strings[i]);
     }
     printf("\n");
+}
 
-
-    struct ub_ac* ac;
-    r = ub_parse_ac(hFile, &ac);
-    struct ub_ss* ss;
-    r = ub_parse_ss(hFile, &ss);
-    g_ss = ss;
-
+void print_ac(struct ub_ac* ac) {
     printf("# Parsing the Application.Command section\n");
     printf("count = %d\n", ac->count);
     for (int i = 0; i < ac->count; i++) {
@@ -136,8 +128,9 @@ void parse(FILE* hFile) {
         }
     }
     printf("\n");
+}
 
-
+void print_ss(struct ub_ss* ss) {
     printf("# Parsing the String section\n");
     printf("length = %d\n", ss->length);
     printf("count = %d\n", ss->count);
@@ -148,53 +141,1437 @@ void parse(FILE* hFile) {
         printf("   %S \n", string->wchars);
     }
     printf("\n");
+}
 
-    if (ub_byte(hFile) != 0x0D)
-        return UB_ERRMSG(UB_SRC_TS, UB_MSG_INVALID_FORMAT);
-    if (ub_word(hFile) != 0x0003)
-        return UB_ERRMSG(UB_SRC_TS, UB_MSG_INVALID_FORMAT);
-    uint32_t ps_offset = ub_dword(hFile);
-
-    struct ub_ts_node* rootNode;
-    r= ub_parse_ts_tag(hFile, &rootNode);
+void print_ts(struct ub_doc* doc) {
     printf("# Parsing the Tree section\n");
-    print_ts_node(rootNode, 0);
+    print_ts_node(doc->root, 0);
     printf("\n");
     printf("\n");
     printf("\n");
 
     printf("# Parsing the Supplementary Tree section\n");
-    for (int i = 0; i < ub_ts_pointer_count(); i++) {
-        uint32_t offset = ub_ts_pointer_get(i)->target_addr;
-        printf("Addr = 0x%04X\n", offset);
-        fseek(hFile, offset, SEEK_SET);
+    for (uint32_t i = 0; i < doc->pointer_count; i++) {
+        printf("Addr = 0x%04X\n", doc->pointers[i]->target_addr);
+        print_ts_coll(doc->pointers[i]->target_coll, 0);
+
+        printf("\n");
+    }
+}
+
+void print_section(struct ub_doc* doc, enum ub_section section) {
+    g_ss = doc->ss;
+
+    switch (section) {
+    case UB_SECTION_HEADER:
+        print_header(doc);
+        break;
+    case UB_SECTION_USS:
+        print_uss(doc->uss);
+        break;
+    case UB_SECTION_AC:
+        print_ac(doc->ac);
+        break;
+    case UB_SECTION_SS:
+        print_ss(doc->ss);
+        break;
+    case UB_SECTION_TS:
+        print_ts(doc);
+        break;
+    }
+}
+
+void print_doc(struct ub_doc* doc) {
+    for (int i = 0; i < ub_section_len; i++)
+        print_section(doc, i);
+}
+
+void parse(FILE* hFile) {
+    struct ub_doc* doc;
+    int r = ub_parse_doc(hFile, &doc);
+    if (r != UB_OK) {
+        printf("Failed to parse, section = %d, error = 0x%08X\n", UB_ERRMSG_SRC(r), r);
+        return;
+    }
+
+    print_doc(doc);
+    ub_free_doc(doc);
+}
+
+int xaml(FILE* hFile) {
+    struct ub_doc* doc;
+    int r = ub_parse_doc(hFile, &doc);
+    if (r != UB_OK) {
+        fprintf(stderr, "Failed to parse, section = %d, error = 0x%08X\n", UB_ERRMSG_SRC(r), r);
+        return r;
+    }
+
+    r = ub_write_xaml(doc, stdout);
+    ub_free_doc(doc);
+    return r;
+}
+
+// Resident mode, a named pipe server keeping the recently parsed binaries in memory.
+// Each worker thread serves one client at a time, all of them share the cache
+#define DOC_CACHE_SIZE 16
+#define SERVER_PIPE_NAME "\\\\.\\pipe\\uicc_bml_parser"
+#define SERVER_BUFSIZE 65536
+#define SERVER_MAX_PARSE (16 * 1024 * 1024)
+
+struct cached_doc {	// Freed when neither the cache nor a request uses it
+    struct ub_doc* doc;
+    volatile LONG refs;
+};
+
+static struct doc_cache_entry {
+    char path[260];
+    time_t mtime;
+    off_t size;
+    uint32_t last_use;
+    struct cached_doc* cached;
+} doc_cache[DOC_CACHE_SIZE];
+static uint32_t doc_cache_tick = 0;
+static CRITICAL_SECTION doc_cache_lock;
+
+void doc_release(struct cached_doc* cached) {
+    if (InterlockedDecrement(&cached->refs) == 0) {
+        ub_free_doc(cached->doc);
+        free(cached);
+    }
+}
+
+// Returns a reference to release with doc_release, or NULL with the reason in error. The modification
+// time has a resolution of one second, so the size is compared as well
+struct cached_doc* doc_cache_get(const char* path, const char** error) {
+    struct stat st;
+    *error = "failed to load the UICC bml file";
+    if (strlen(path) >= sizeof(doc_cache[0].path) || stat(path, &st) != 0)
+        return NULL;
+
+    EnterCriticalSection(&doc_cache_lock);
+    for (int i = 0; i < DOC_CACHE_SIZE; i++) {
+        struct doc_cache_entry* entry = doc_cache + i;
+        if (entry->cached != NULL && strcmp(entry->path, path) == 0 &&
+            entry->mtime == st.st_mtime && entry->size == st.st_size) {
+            entry->last_use = ++doc_cache_tick;
+            InterlockedIncrement(&entry->cached->refs);
+            LeaveCriticalSection(&doc_cache_lock);
+            return entry->cached;
+        }
+    }
+    LeaveCriticalSection(&doc_cache_lock);
+
+    // Parse without holding the lock, a file requested by two clients at once may be parsed twice.
+    // The parser trusts the counts and lengths, so the file is validated first, as with parse <size>
+    if (st.st_size > SERVER_MAX_PARSE) {
+        *error = "the binary is too large";
+        return NULL;
+    }
+    FILE* hFile = fopen(path, "rb");
+    if (hFile == NULL)
+        return NULL;
+    struct ub_doc* doc = NULL;
+    struct ub_buf* buf;
+    int r = ub_buf_load(hFile, &buf);
+    if (r == UB_OK) {
+        if (ub_validate(buf->data, buf->size, NULL, NULL) != 0) {
+            *error = "the binary failed the validation";
+            r = UB_FAILED;
+        }
+        else if (fseek(hFile, 0, SEEK_SET) != 0 || (r = ub_parse_doc(hFile, &doc)) != UB_OK) {
+            *error = "failed to parse the binary";
+            r = UB_FAILED;
+        }
+        ub_free_buf(buf);
+    }
+    fclose(hFile);
+    if (r != UB_OK)
+        return NULL;
+
+    struct cached_doc* cached = malloc(sizeof(struct cached_doc));
+    cached->doc = doc;
+    cached->refs = 2;   // The cache and the caller
+
+    // Replace the entry of the same file, otherwise take an empty or the least recently used one
+    EnterCriticalSection(&doc_cache_lock);
+    struct doc_cache_entry* slot = NULL;
+    for (int i = 0; i < DOC_CACHE_SIZE; i++) {
+        struct doc_cache_entry* entry = doc_cache + i;
+        if (entry->cached != NULL && strcmp(entry->path, path) == 0) {
+            slot = entry;
+            break;
+        }
+        if (slot == NULL || (slot->cached != NULL && (entry->cached == NULL || entry->last_use < slot->last_use)))
+            slot = entry;
+    }
+    if (slot->cached != NULL)
+        doc_release(slot->cached);
+    strcpy(slot->path, path);
+    slot->mtime = st.st_mtime;
+    slot->size = st.st_size;
+    slot->last_use = ++doc_cache_tick;
+    slot->cached = cached;
+    LeaveCriticalSection(&doc_cache_lock);
+
+    return cached;
+}
+
+// The reply to a request is collected and written to the pipe at once
+struct reply {
+    char* data;
+    uint32_t size;
+    uint32_t capacity;
+};
+
+static void reply_put(struct reply* reply, const char* str, uint32_t len) {
+    if (reply->size + len > reply->capacity) {
+        uint32_t capacity = reply->capacity == 0 ? 4096 : reply->capacity;
+        while (capacity < reply->size + len)
+            capacity *= 2;
+        reply->data = realloc(reply->data, capacity);
+        reply->capacity = capacity;
+    }
+    memcpy(reply->data + reply->size, str, len);
+    reply->size += len;
+}
+
+static void reply_printf(struct reply* reply, const char* format, ...) {
+    char buf[256];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+    if (len > 0)
+        reply_put(reply, buf, len < (int)sizeof(buf) ? len : (int)sizeof(buf) - 1);
+}
+
+// A JSON string from little-endian UTF-16
+static void reply_json_wstr(struct reply* reply, const uint16_t* wchars, uint32_t count) {
+    reply_put(reply, "\"", 1);
+    for (uint32_t i = 0; i < count;) {
+        uint32_t c;
+        i += ub_utf16_get((const uint8_t*)(wchars + i), count - i, &c);
+        if (c == '"' || c == '\\') {
+            char escaped[2] = {'\\', (char)c};
+            reply_put(reply, escaped, 2);
+        }
+        else if (c < 0x20) {
+            reply_printf(reply, "\\u%04X", c);
+        }
+        else {
+            uint8_t utf8[4];
+            reply_put(reply, (const char*)utf8, ub_utf8_put(c, utf8));
+        }
+    }
+    reply_put(reply, "\"", 1);
+}
+
+// The strings of the Unknown String Section are ASCII
+static void reply_json_str(struct reply* reply, const char* str) {
+    reply_put(reply, "\"", 1);
+    for (; *str != 0; str++) {
+        if (*str == '"' || *str == '\\')
+            reply_printf(reply, "\\%c", *str);
+        else if ((uint8_t)*str < 0x20 || (uint8_t)*str >= 0x80)
+            reply_printf(reply, "\\u%04X", (uint8_t)*str);
+        else
+            reply_put(reply, str, 1);
+    }
+    reply_put(reply, "\"", 1);
+}
+
+static void json_tag(struct reply* reply, void* tag) {
+    enum ub_ts_type tag_type = *((enum ub_ts_type*)tag);
+    if (tag_type == UB_TST_NODE) {
+        struct ub_ts_node* node = tag;
+        reply_printf(reply, "{\"node\":%d,\"fpos\":%d,\"children\":[", node->type, node->fpos);
+        for (int i = 0; i < node->child_count; i++) {
+            if (i > 0)
+                reply_put(reply, ",", 1);
+            json_tag(reply, node->child_ptrs[i]);
+        }
+        reply_put(reply, "]}", 2);
+    }
+    else if (tag_type == UB_TST_COLLECTION) {
+        struct ub_ts_collection* coll = tag;
+        reply_printf(reply, "{\"collection\":%d,\"fpos\":%d,\"children\":[", coll->type, coll->fpos);
+        for (int i = 0; i < coll->child_count; i++) {
+            if (i > 0)
+                reply_put(reply, ",", 1);
+            json_tag(reply, coll->child_ptrs[i]);
+        }
+        reply_put(reply, "]}", 2);
+    }
+    else if (tag_type == UB_TST_PROP) {
+        struct ub_ts_prop* prop = tag;
+        reply_printf(reply, "{\"prop\":[%d,%d,%d],", prop->type_b1, prop->type_b2, prop->type_b3);
+        int len = ub_ts_prop_len(prop);
+        if (len > 4) {
+            reply_put(reply, "\"bytes\":[", 9);
+            for (int i = 0; i < len; i++)
+                reply_printf(reply, i == 0 ? "%d" : ",%d", prop->data_ptr[i]);
+            reply_put(reply, "]}", 2);
+        }
+        else {
+            reply_printf(reply, "\"value\":%u}", prop->data);
+        }
+    }
+    else if (tag_type == UB_TST_POINTER) {
+        reply_printf(reply, "{\"pointer\":%u}", ((struct ub_ts_pointer*)tag)->target_addr);
+    }
+    else {
+        struct ub_ts_3B* ts3b = tag;
+        reply_printf(reply, "{\"ts3b\":%d,\"value\":%u}", ts3b->type, ts3b->data);
+    }
+}
+
+// One section of the binary as JSON members, the Tree Section together with the supplementary blocks
+void json_section(struct reply* reply, struct ub_doc* doc, int section) {
+    if (section == UB_SECTION_HEADER) {
+        reply_printf(reply, "\"size\":%u", doc->size);
+    }
+    else if (section == UB_SECTION_USS) {
+        reply_put(reply, "\"uss\":[", 7);
+        for (int i = 0; i < doc->uss->count; i++) {
+            if (i > 0)
+                reply_put(reply, ",", 1);
+            reply_json_str(reply, doc->uss->strings[i]);
+        }
+        reply_put(reply, "]", 1);
+    }
+    else if (section == UB_SECTION_AC) {
+        reply_put(reply, "\"commands\":[", 12);
+        for (uint32_t i = 0; i < doc->ac->count; i++) {
+            struct ub_ac_tag* tag = doc->ac->tags[i];
+            reply_printf(reply, "%s{\"id\":%d,\"properties\":[", i > 0 ? "," : "", tag->id);
+            for (int j = 0; j < tag->count; j++) {
+                struct ub_ac_pair* pair = tag->properties[j];
+                reply_printf(reply, "%s{\"type\":%d,\"value\":%u,\"auxdata\":%u}", j > 0 ? "," : "",
+                    (int)pair->type, pair->value, pair->auxdata);
+            }
+            reply_put(reply, "]}", 2);
+        }
+        reply_put(reply, "]", 1);
+    }
+    else if (section == UB_SECTION_SS) {
+        reply_put(reply, "\"strings\":[", 11);
+        for (uint32_t i = 0; i < doc->ss->count; i++) {
+            struct ub_ss_string* ss_string = doc->ss->strings[i];
+            reply_printf(reply, "%s{\"id\":%d,\"type\":%d,\"text\":", i > 0 ? "," : "", ss_string->id, ss_string->type);
+            reply_json_wstr(reply, ss_string->wchars, ss_string->length >> 1);
+            reply_put(reply, "}", 1);
+        }
+        reply_put(reply, "]", 1);
+    }
+    else {
+        reply_put(reply, "\"tree\":", 7);
+        json_tag(reply, doc->root);
+
+        reply_put(reply, ",\"supplementary\":[", 18);
+        for (uint32_t i = 0; i < doc->pointer_count; i++) {
+            reply_printf(reply, "%s{\"addr\":%u,\"collection\":", i > 0 ? "," : "", doc->pointers[i]->target_addr);
+            if (doc->pointers[i]->target_coll != NULL)
+                json_tag(reply, doc->pointers[i]->target_coll);
+            else
+                reply_put(reply, "null", 4);
+            reply_put(reply, "}", 1);
+        }
+        reply_put(reply, "]", 1);
+    }
+}
+
+// The whole binary as one line of JSON
+void json_doc(struct reply* reply, struct ub_doc* doc) {
+    reply_put(reply, "{", 1);
+    for (int i = 0; i < ub_section_len; i++) {
+        if (i > 0)
+            reply_put(reply, ",", 1);
+        json_section(reply, doc, i);
+    }
+    reply_put(reply, "}\n", 2);
+}
 
-        uint16_t length = ub_word(hFile);
-        struct ub_ts_collection* coll;
-        r = ub_parse_ts_tag(hFile, &coll);
+void list_ts_nodes(struct reply* reply, void* tag, enum ub_object_type type) {
+    enum ub_ts_type tag_type = *((enum ub_ts_type*)tag);
+    if (tag_type == UB_TST_NODE) {
+        struct ub_ts_node* node = tag;
+        if (node->type == type)
+            reply_printf(reply, "0x%04X @0x%04X, %d children\n", node->type, node->fpos, node->child_count);
+        for (int i = 0; i < node->child_count; i++)
+            if (node->child_ptrs[i] != NULL)
+                list_ts_nodes(reply, node->child_ptrs[i], type);
+    }
+    else if (tag_type == UB_TST_COLLECTION) {
+        struct ub_ts_collection* coll = tag;
+        for (int i = 0; i < coll->child_count; i++)
+            if (coll->child_ptrs[i] != NULL)
+                list_ts_nodes(reply, coll->child_ptrs[i], type);
+    }
+}
+
+struct client {
+    HANDLE hPipe;
+    char in[SERVER_BUFSIZE];
+    uint32_t in_start;
+    uint32_t in_size;
+    struct reply reply;
+};
+
+// Returns 0 if the client is gone
+static int client_fill(struct client* client) {
+    if (client->in_start > 0) {
+        memmove(client->in, client->in + client->in_start, client->in_size - client->in_start);
+        client->in_size -= client->in_start;
+        client->in_start = 0;
+    }
+    DWORD read = 0;
+    if (client->in_size == sizeof(client->in) ||
+        !ReadFile(client->hPipe, client->in + client->in_size, sizeof(client->in) - client->in_size, &read, NULL) || read == 0)
+        return 0;
+    client->in_size += read;
+    return 1;
+}
+
+// The next request without its line break, NULL if the client is gone or the line is too long
+static char* client_line(struct client* client) {
+    uint32_t scanned = 0;   // Bytes after in_start without a line break
+    for (;;) {
+        char* line = client->in + client->in_start;
+        char* end = memchr(line + scanned, '\n', client->in_size - client->in_start - scanned);
+        if (end != NULL) {
+            client->in_start = (uint32_t)(end + 1 - client->in);
+            *end = 0;
+            line[strcspn(line, "\r")] = 0;
+            return line;
+        }
+        scanned = client->in_size - client->in_start;
+        if (!client_fill(client))
+            return NULL;
+    }
+}
+
+static int client_bytes(struct client* client, uint8_t* dst, uint32_t len) {
+    while (len > 0) {
+        if (client->in_start == client->in_size) {
+            client->in_start = client->in_size = 0;
+            if (!client_fill(client))
+                return 0;
+        }
+        uint32_t chunk = client->in_size - client->in_start;
+        if (chunk > len)
+            chunk = len;
+        memcpy(dst, client->in + client->in_start, chunk);
+        client->in_start += chunk;
+        dst += chunk;
+        len -= chunk;
+    }
+    return 1;
+}
+
+static int client_send(struct client* client) {
+    uint32_t sent = 0;
+    while (sent < client->reply.size) {
+        DWORD written = 0;
+        if (!WriteFile(client->hPipe, client->reply.data + sent, client->reply.size - sent, &written, NULL))
+            return 0;
+        sent += written;
+    }
+    client->reply.size = 0;
+    return 1;
+}
+
+// parse <size> is followed by the binary itself, which is parsed through a temporary file and not cached
+static void serve_parse(struct client* client, uint32_t size) {
+    struct reply* reply = &client->reply;
+    uint8_t* data = malloc(size + (size_t)1);
+    if (!client_bytes(client, data, size)) {
+        free(data);
+        return;
+    }
+
+    struct ub_doc* doc = NULL;
+    FILE* hTemp = NULL;
+    if (ub_validate(data, size, NULL, NULL) != 0)
+        reply_printf(reply, "ERROR: the binary failed the validation\n");
+    else if ((hTemp = tmpfile()) == NULL || fwrite(data, 1, size, hTemp) != size)
+        reply_printf(reply, "ERROR: failed to create a temporary file\n");
+    else if (fseek(hTemp, 0, SEEK_SET) != 0 || ub_parse_doc(hTemp, &doc) != UB_OK)
+        reply_printf(reply, "ERROR: failed to parse the binary\n");
+    else {
+        json_doc(reply, doc);
+        reply_printf(reply, "OK\n");
+    }
+
+    if (doc != NULL)
+        ub_free_doc(doc);
+    if (hTemp != NULL)
+        fclose(hTemp);
+    free(data);
+}
+
+// One request per line, the file path is always the rest of the line:
+//   json <path>
+//   parse <size>, followed by size bytes of a binary
+//   string <id> <path>
+//   nodes <object type> <path>
+//   quit
+// Each reply ends with a line of "OK" or "ERROR: <reason>"
+static void serve_client(struct client* client) {
+    struct reply* reply = &client->reply;
+    char* line;
 
-        print_ts_coll(coll, 0);
+    client->in_start = client->in_size = 0;
+    while ((line = client_line(client)) != NULL) {
+        char* cmd = strtok(line, " \t");
+        if (cmd == NULL)
+            continue;
+        if (strcmp(cmd, "quit") == 0)
+            break;
+
+        int has_arg = strcmp(cmd, "string") == 0 || strcmp(cmd, "nodes") == 0 || strcmp(cmd, "parse") == 0;
+        char* str_arg = has_arg ? strtok(NULL, " \t") : NULL;
+        uint32_t arg = str_arg == NULL ? 0 : strtoul(str_arg, NULL, 0);
+        char* path = strtok(NULL, "");
+        path = path == NULL ? NULL : path + strspn(path, " \t");
+
+        if (strcmp(cmd, "json") != 0 && !has_arg) {
+            reply_printf(reply, "ERROR: unknown request\n");
+        }
+        else if (has_arg && str_arg == NULL) {
+            reply_printf(reply, "ERROR: missing argument\n");
+        }
+        else if (strcmp(cmd, "parse") == 0) {
+            if (arg > SERVER_MAX_PARSE) {
+                reply_printf(reply, "ERROR: the binary is too large\n");
+                client_send(client);
+                break;
+            }
+            serve_parse(client, arg);
+        }
+        else {
+            const char* error = "missing path";
+            struct cached_doc* cached = (path == NULL || *path == 0) ? NULL : doc_cache_get(path, &error);
+            if (cached == NULL) {
+                reply_printf(reply, "ERROR: %s\n", error);
+            }
+            else {
+                struct ub_doc* doc = cached->doc;
+                if (strcmp(cmd, "json") == 0) {
+                    json_doc(reply, doc);
+                }
+                else if (strcmp(cmd, "string") == 0) {
+                    struct ub_ss_string* ss_string = arg > 0xFFFF ? NULL : ub_ss_find(doc->ss, arg);
+                    if (ss_string != NULL)
+                        reply_json_wstr(reply, ss_string->wchars, ss_string->length >> 1);
+                    reply_put(reply, "\n", 1);
+                }
+                else {
+                    list_ts_nodes(reply, doc->root, arg);
+                    for (uint32_t i = 0; i < doc->pointer_count; i++)
+                        if (doc->pointers[i]->target_coll != NULL)
+                            list_ts_nodes(reply, doc->pointers[i]->target_coll, arg);
+                }
+                reply_printf(reply, "OK\n");
+                doc_release(cached);
+            }
+        }
+
+        if (!client_send(client))
+            break;
+    }
+    client->reply.size = 0;
+}
+
+// Only the user running the server may open the pipe, the ACL must stay alive as long as the pipe instances
+static SECURITY_ATTRIBUTES server_security;
+static SECURITY_DESCRIPTOR server_descriptor;
+static ACL* server_acl = NULL;
+
+static int server_security_init(void) {
+    HANDLE hToken;
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &hToken))
+        return 0;
+
+    DWORD size = 0;
+    GetTokenInformation(hToken, TokenUser, NULL, 0, &size);
+    TOKEN_USER* user = size == 0 ? NULL : malloc(size);
+    int ok = user != NULL && GetTokenInformation(hToken, TokenUser, user, size, &size);
+    CloseHandle(hToken);
+
+    // GENERIC_ALL includes FILE_CREATE_PIPE_INSTANCE, which the other threads need to create their instances
+    if (ok) {
+        DWORD acl_size = sizeof(ACL) + sizeof(ACCESS_ALLOWED_ACE) + GetLengthSid(user->User.Sid);
+        server_acl = malloc(acl_size);
+        ok = server_acl != NULL && InitializeAcl(server_acl, acl_size, ACL_REVISION) &&
+            AddAccessAllowedAce(server_acl, ACL_REVISION, GENERIC_ALL, user->User.Sid) &&
+            InitializeSecurityDescriptor(&server_descriptor, SECURITY_DESCRIPTOR_REVISION) &&
+            SetSecurityDescriptorDacl(&server_descriptor, TRUE, server_acl, FALSE);
+    }
+    free(user);
+
+    server_security.nLength = sizeof(SECURITY_ATTRIBUTES);
+    server_security.lpSecurityDescriptor = &server_descriptor;
+    server_security.bInheritHandle = FALSE;
+    return ok;
+}
 
+DWORD WINAPI server_thread(LPVOID param) {
+    const char* pipe_name = param;
+    struct client* client = calloc(1, sizeof(struct client));
+
+    for (;;) {
+        client->hPipe = CreateNamedPipeA(pipe_name, PIPE_ACCESS_DUPLEX,
+            PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+            PIPE_UNLIMITED_INSTANCES, SERVER_BUFSIZE, SERVER_BUFSIZE, 0, &server_security);
+        if (client->hPipe == INVALID_HANDLE_VALUE)
+            break;
+
+        if (ConnectNamedPipe(client->hPipe, NULL) || GetLastError() == ERROR_PIPE_CONNECTED)
+            serve_client(client);
+
+        FlushFileBuffers(client->hPipe);
+        DisconnectNamedPipe(client->hPipe);
+        CloseHandle(client->hPipe);
+    }
+
+    free(client->reply.data);
+    free(client);
+    return 0;
+}
+
+// Runs until the process is stopped, as many clients are served at once as there are threads
+void resident(const char* pipe_name) {
+    if (!server_security_init()) {
+        printf("Failed to create the security descriptor of the named pipe!\n");
+        free(server_acl);
+        return;
+    }
+    InitializeCriticalSection(&doc_cache_lock);
+
+    int thread_count = worker_count(MAXIMUM_WAIT_OBJECTS);
+    HANDLE* threads = malloc(sizeof(HANDLE) * thread_count);
+    for (int i = 0; i < thread_count; i++)
+        threads[i] = CreateThread(NULL, 0, server_thread, (LPVOID)pipe_name, 0, NULL);
+    printf("Serving %s with %d threads\n", pipe_name, thread_count);
+    fflush(stdout);
+    WaitForMultipleObjects(thread_count, threads, TRUE, INFINITE);
+
+    printf("Failed to create the named pipe!\n");
+    for (int i = 0; i < thread_count; i++)
+        CloseHandle(threads[i]);
+    free(threads);
+    for (int i = 0; i < DOC_CACHE_SIZE; i++)
+        if (doc_cache[i].cached != NULL)
+            doc_release(doc_cache[i].cached);
+    DeleteCriticalSection(&doc_cache_lock);
+    free(server_acl);
+}
+
+static const char* src_names[ub_src_len] = {"Unknown", "File", "USS", "AC", "SS", "TS", "PS"};
+
+void print_problem(void* ctx, uint32_t fpos, int err, const char* desc) {
+    printf("%s: @0x%04X [%s] %s\n", (const char*)ctx, fpos, src_names[UB_ERRMSG_SRC(err)], desc);
+}
+
+// Returns the number of inconsistencies
+uint32_t validate(const char* filename) {
+    FILE* hFile = fopen(filename, "rb");
+    if (hFile == NULL) {
+        printf("%s: failed to open\n", filename);
+        return 1;
+    }
+
+    struct ub_buf* buf;
+    int r = ub_buf_load(hFile, &buf);
+    fclose(hFile);
+    if (r != UB_OK) {
+        printf("%s: failed to read\n", filename);
+        return 1;
+    }
+
+    uint32_t count = ub_validate(buf->data, buf->size, print_problem, (void*)filename);
+    if (count == 0)
+        printf("%s: OK\n", filename);
+
+    ub_free_buf(buf);
+    return count;
+}
+
+// Replace old_len bytes at offset with the bytes in hex and save the fixed up binary as out_name
+int splice(const char* in_name, uint32_t offset, uint32_t old_len, const char* hex, const char* out_name) {
+    size_t hex_len = strlen(hex);
+    if (hex_len % 2 != 0 || strspn(hex, "0123456789abcdefABCDEF") != hex_len) {
+        printf("Invalid hex bytes!\n");
+        return UB_FAILED;
+    }
+    uint32_t new_len = (uint32_t)(hex_len / 2);
+    uint8_t* bytes = malloc(new_len + (size_t)1);
+    for (uint32_t i = 0; i < new_len; i++) {
+        char digits[3] = {hex[i * 2], hex[i * 2 + 1], 0};
+        bytes[i] = (uint8_t)strtoul(digits, NULL, 16);
+    }
+
+    FILE* hFile = fopen(in_name, "rb");
+    if (hFile == NULL) {
+        printf("Failed to open the UICC bml file!\n");
+        free(bytes);
+        return UB_FAILED;
+    }
+
+    struct ub_doc* doc = NULL;
+    struct ub_buf* buf = NULL;
+    int r = ub_parse_doc(hFile, &doc);
+    if (r == UB_OK)
+        r = ub_buf_load(hFile, &buf);
+    fclose(hFile);
+    if (r == UB_OK)
+        r = ub_splice(buf, doc, offset, old_len, bytes, new_len);
+
+    if (r != UB_OK) {
+        printf("Failed to splice, section = %d, error = 0x%08X\n", UB_ERRMSG_SRC(r), r);
+    }
+    else {
+        FILE* hOut = fopen(out_name, "wb");
+        if (hOut == NULL || ub_buf_save(buf, hOut) != UB_OK) {
+            printf("Failed to write %s!\n", out_name);
+            r = UB_FAILED;
+        }
+        if (hOut != NULL)
+            fclose(hOut);
+    }
+
+    if (buf != NULL)
+        ub_free_buf(buf);
+    if (doc != NULL)
+        ub_free_doc(doc);
+    free(bytes);
+    return r;
+}
+
+// One thread per CPU, at most max_count
+int worker_count(int max_count) {
+    SYSTEM_INFO sysinfo;
+    GetSystemInfo(&sysinfo);
+    int thread_count = sysinfo.dwNumberOfProcessors;
+    if (thread_count > MAXIMUM_WAIT_OBJECTS)
+        thread_count = MAXIMUM_WAIT_OBJECTS;
+    if (thread_count > max_count)
+        thread_count = max_count;
+    if (thread_count < 1)
+        thread_count = 1;
+    return thread_count;
+}
+
+// Files shared among the worker threads, each thread takes the next one
+struct file_job {
+    char** files;
+    LONG file_count;
+    volatile LONG next;
+};
+
+// Corpus statistics, each thread fills its own ub_stats and they are merged at the end
+struct stats_worker {
+    struct file_job* job;
+    struct ub_stats* stats;
+};
+
+DWORD WINAPI stats_thread(LPVOID param) {
+    struct stats_worker* worker = param;
+    struct file_job* job = worker->job;
+
+    for (;;) {
+        LONG i = InterlockedIncrement(&job->next) - 1;
+        if (i >= job->file_count)
+            break;
+
+        FILE* hFile = fopen(job->files[i], "rb");
+        if (hFile == NULL) {
+            worker->stats->skipped++;
+            continue;
+        }
+        struct ub_buf* buf;
+        int r = ub_buf_load(hFile, &buf);
+        fclose(hFile);
+        if (r != UB_OK) {
+            worker->stats->skipped++;
+            continue;
+        }
+
+        ub_stats_add(worker->stats, buf->data, buf->size, NULL);
+        ub_free_buf(buf);
+    }
+
+    return 0;
+}
+
+int compare_stat_entry(const void* a, const void* b) {
+    const struct ub_stat_entry* x = *(const struct ub_stat_entry**)a;
+    const struct ub_stat_entry* y = *(const struct ub_stat_entry**)b;
+    uint64_t kx = ((uint64_t)x->kind << 40) | ((uint64_t)x->b2 << 32) | ((uint64_t)x->b1 << 24) | ((uint64_t)x->b3 << 16) | x->parent_type;
+    uint64_t ky = ((uint64_t)y->kind << 40) | ((uint64_t)y->b2 << 32) | ((uint64_t)y->b1 << 24) | ((uint64_t)y->b3 << 16) | y->parent_type;
+    return kx < ky ? -1 : kx > ky;
+}
+
+void print_stats(struct ub_stats* stats) {
+    printf("# Statistics of %d files, %d failed the validation, %d skipped\n", stats->files, stats->invalid, stats->skipped);
+
+    struct ub_stat_entry** sorted = malloc(sizeof(struct ub_stat_entry*) * (stats->used + (size_t)1));
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < stats->capacity; i++)
+        if (stats->entries[i].kind != 0)
+            sorted[count++] = stats->entries + i;
+    qsort(sorted, count, sizeof(struct ub_stat_entry*), compare_stat_entry);
+
+    for (uint32_t i = 0; i < count; i++) {
+        struct ub_stat_entry* entry = sorted[i];
+        if (entry->kind == UB_STAT_AC) {
+            printf("AC 0x%02X (%s)", entry->b1, ub_prop_type_str(entry->b1));
+        }
+        else if (entry->kind == UB_STAT_PROP) {
+            struct ub_ts_prop prop = {UB_TST_PROP, entry->b1, entry->b2, entry->b3};
+            const char* name = ub_ts_prop_name_str(&prop);
+            printf("Prop (01 %02X %02X %02X) %s", entry->b1, entry->b2, entry->b3, name == NULL ? "Unknown" : name);
+        }
+        else if (entry->kind == UB_STAT_NODE) {
+            enum ub_object_type type = entry->b1 | (entry->b2 << 8);
+            printf("Node 0x%04X (%s)", type, ub_obj_type_str(type));
+        }
+        else if (entry->kind == UB_STAT_COLLECTION) {
+            printf("Collection 0x%02X", entry->b1);
+        }
+        else {
+            printf("TS3B 0x%02X", entry->b1);
+        }
+
+        if (entry->kind != UB_STAT_AC)
+            printf(" in 0x%04X (%s)", entry->parent_type, entry->parent_type == 0 ? "Tree Section" : ub_obj_type_str(entry->parent_type));
+        printf(": count = %d, value = 0x%X - 0x%X", entry->count, entry->value_min, entry->value_max);
+
+        if (entry->len_mask != 0) {
+            printf(", len =");
+            for (int j = 0; j < 32; j++)
+                if (entry->len_mask & (1u << j))
+                    printf(" %d", j);
+        }
+
+        printf(", bits =");
+        for (int j = 0; j < 33; j++)
+            if (entry->value_bits[j] != 0)
+                printf(" %d:%d", j, entry->value_bits[j]);
         printf("\n");
     }
 
+    free(sorted);
+}
+
+void stats(char** files, int file_count) {
+    int thread_count = worker_count(file_count);
+
+    struct file_job job = {files, file_count, 0};
+    struct stats_worker* workers = malloc(sizeof(struct stats_worker) * thread_count);
+    HANDLE* threads = malloc(sizeof(HANDLE) * thread_count);
+    for (int i = 0; i < thread_count; i++) {
+        workers[i].job = &job;
+        workers[i].stats = ub_new_stats();
+        threads[i] = CreateThread(NULL, 0, stats_thread, workers + i, 0, NULL);
+    }
+    WaitForMultipleObjects(thread_count, threads, TRUE, INFINITE);
 
-    //printf("Tree Section starts at 0x%04X\n", ftell(hFile));
-    //uint32_t sz = ps_offset - ftell(hFile);
-    //uint8_t* mem = malloc(sz);
-    //fread(mem, 1, sz, hFile);
+    struct ub_stats* total = ub_new_stats();
+    for (int i = 0; i < thread_count; i++) {
+        CloseHandle(threads[i]);
+        ub_stats_merge(total, workers[i].stats);
+        ub_free_stats(workers[i].stats);
+    }
+    print_stats(total);
 
-    //FILE* bin = fopen("tree.bin", "wb");
-    //fwrite(mem, 1, sz, bin);
-    //fclose(bin);
+    ub_free_stats(total);
+    free(threads);
+    free(workers);
+}
 
-    //free(mem);
+// Columnar export, each thread collects its own batch of rows and the batches are written one after another
+struct export_worker {
+    struct file_job* job;
+    struct ub_columns* cols;
+};
 
-    ub_free_uss(uss);
-    ub_free_ac(ac);
-    ub_free_ss(ss);
+DWORD WINAPI export_thread(LPVOID param) {
+    struct export_worker* worker = param;
+    struct file_job* job = worker->job;
 
-    return;
+    for (;;) {
+        LONG i = InterlockedIncrement(&job->next) - 1;
+        if (i >= job->file_count)
+            break;
+
+        // A file which can not be read still gets its row in the files table
+        struct ub_buf* buf = NULL;
+        FILE* hFile = fopen(job->files[i], "rb");
+        if (hFile != NULL) {
+            ub_buf_load(hFile, &buf);
+            fclose(hFile);
+        }
+
+        ub_columns_add(worker->cols, i, job->files[i], buf == NULL ? NULL : buf->data, buf == NULL ? 0 : buf->size);
+        if (buf != NULL)
+            ub_free_buf(buf);
+    }
+
+    return 0;
+}
+
+void export_columns(const char* out_name, char** files, int file_count) {
+    int thread_count = worker_count(file_count);
+
+    struct file_job job = {files, file_count, 0};
+    struct export_worker* workers = malloc(sizeof(struct export_worker) * thread_count);
+    HANDLE* threads = malloc(sizeof(HANDLE) * thread_count);
+    for (int i = 0; i < thread_count; i++) {
+        workers[i].job = &job;
+        workers[i].cols = ub_new_columns();
+        threads[i] = CreateThread(NULL, 0, export_thread, workers + i, 0, NULL);
+    }
+    WaitForMultipleObjects(thread_count, threads, TRUE, INFINITE);
+
+    struct ub_columns** batches = malloc(sizeof(struct ub_columns*) * thread_count);
+    for (int i = 0; i < thread_count; i++) {
+        CloseHandle(threads[i]);
+        batches[i] = workers[i].cols;
+    }
+
+    FILE* hOut = fopen(out_name, "wb");
+    if (hOut == NULL || ub_columns_write(batches, thread_count, hOut) != UB_OK)
+        printf("Failed to write %s!\n", out_name);
+    if (hOut != NULL)
+        fclose(hOut);
+
+    for (int i = 0; i < thread_count; i++)
+        ub_free_columns(batches[i]);
+    free(batches);
+    free(threads);
+    free(workers);
+}
+
+// Maps an export and prints its tables, the columns are used in place
+void print_columns(const char* filename) {
+    static const char* table_names[ub_table_len] = {"files", "commands", "strings", "nodes", "properties"};
+
+    HANDLE hFile = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) {
+        printf("Failed to open the export!\n");
+        return;
+    }
+    LARGE_INTEGER file_size;
+    HANDLE hMapping = NULL;
+    const uint8_t* data = NULL;
+    if (GetFileSizeEx(hFile, &file_size) && file_size.QuadPart != 0 && (uint64_t)file_size.QuadPart <= SIZE_MAX)
+        hMapping = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (hMapping != NULL)
+        data = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+
+    struct ub_columns_view view;
+    if (data == NULL || ub_columns_map(data, (size_t)file_size.QuadPart, &view) != UB_OK) {
+        printf("Not a valid export!\n");
+    }
+    else {
+        for (int t = 0; t < ub_table_len; t++)
+            printf("%s: %d rows\n", table_names[t], view.rows[t]);
+
+        const uint32_t* sizes = view.cols[UB_COL_FILES_SIZE];
+        const uint8_t* valid = view.cols[UB_COL_FILES_VALID];
+        const uint32_t* name_offsets = view.cols[UB_COL_FILES_NAME_OFFSET];
+        const char* names = view.cols[UB_COL_FILES_NAME];
+        for (uint32_t i = 0; i < view.rows[UB_TABLE_FILES]; i++) {
+            printf("%.*s: %d bytes%s\n", (int)(name_offsets[i + 1] - name_offsets[i]), names + name_offsets[i],
+                sizes[i], valid[i] ? "" : ", failed the validation");
+        }
+    }
+
+    if (data != NULL)
+        UnmapViewOfFile(data);
+    if (hMapping != NULL)
+        CloseHandle(hMapping);
+    CloseHandle(hFile);
+}
+
+// Watch mode, a file is parsed and printed again only for the sections whose bytes changed
+#define WATCH_POLL_MS 1000
+
+struct watch_entry {
+    const char* path;
+    time_t mtime;
+    off_t size;
+    uint64_t hashes[ub_section_len];
+    struct ub_doc* doc;
+    struct reply* json;     // Shared by all the files, NULL to print the text dump
+};
+
+static const char* section_names[ub_section_len] = {"Header", "USS", "AC", "SS", "TS"};
+
+// FNV-1a, seeded with the start, so that a section moved by an edit before it counts as changed
+static uint64_t section_hash(const uint8_t* data, uint32_t start, uint32_t end) {
+    uint64_t hash = 14695981039346656037ull ^ start;
+    for (uint32_t i = start; i < end; i++)
+        hash = (hash ^ data[i]) * 1099511628211ull;
+    return hash;
+}
+
+// One line of JSON per event, with the members of the changed sections
+static void watch_json_flush(struct reply* json) {
+    reply_put(json, "}\n", 2);
+    fwrite(json->data, 1, json->size, stdout);
+    fflush(stdout);
+    json->size = 0;
+}
+
+// force skips the check of the modification time and size, which can miss a quick edit
+void watch_update(struct watch_entry* entry, int force) {
+    struct stat st;
+    if (stat(entry->path, &st) != 0)
+        return;
+    if (!force && entry->doc != NULL && st.st_mtime == entry->mtime && st.st_size == entry->size)
+        return;
+    entry->mtime = st.st_mtime;
+    entry->size = st.st_size;
+
+    clock_t start = clock();
+    FILE* hFile = fopen(entry->path, "rb");
+    if (hFile == NULL)
+        return;
+    struct ub_buf* buf;
+    if (ub_buf_load(hFile, &buf) != UB_OK) {
+        fclose(hFile);
+        return;
+    }
+
+    // The file may be half written, wait for the next change
+    struct reply* json = entry->json;
+    if (json != NULL) {
+        reply_put(json, "{\"file\":", 8);
+        reply_json_str(json, entry->path);
+    }
+    if (ub_validate(buf->data, buf->size, NULL, NULL) != 0) {
+        if (json != NULL) {
+            reply_put(json, ",\"invalid\":true", 15);
+            watch_json_flush(json);
+        }
+        else {
+            printf("## %s: invalid, waiting for the next change\n", entry->path);
+            fflush(stdout);
+        }
+        ub_free_buf(buf);
+        fclose(hFile);
+        return;
+    }
+
+    uint32_t bounds[ub_section_len + 1];
+    ub_section_bounds(buf->data, buf->size, bounds);
+    uint32_t changed = 0;
+    for (int i = 0; i < ub_section_len; i++) {
+        uint64_t hash = section_hash(buf->data, bounds[i], bounds[i + 1]);
+        if (entry->doc == NULL || hash != entry->hashes[i])
+            changed |= 1 << i;
+        entry->hashes[i] = hash;
+    }
+    ub_free_buf(buf);
+
+    int r = UB_OK;
+    if (entry->doc == NULL) {
+        rewind(hFile);
+        r = ub_parse_doc(hFile, &entry->doc);
+    }
+    else if (changed != 0) {
+        r = ub_reparse_doc(hFile, entry->doc, bounds, changed);
+    }
+    fclose(hFile);
+
+    if (r != UB_OK) {
+        if (json != NULL) {
+            reply_printf(json, ",\"error\":%u,\"source\":\"%s\"", (uint32_t)r, src_names[UB_ERRMSG_SRC(r)]);
+            watch_json_flush(json);
+        }
+        else {
+            printf("## %s: failed to parse, section = %d, error = 0x%08X\n", entry->path, UB_ERRMSG_SRC(r), r);
+            fflush(stdout);
+        }
+        if (entry->doc != NULL)
+            ub_free_doc(entry->doc);
+        entry->doc = NULL;
+        return;
+    }
+    if (changed == 0) {
+        if (json != NULL)
+            json->size = 0;
+        return;
+    }
+
+    // Names from the String Section also appear in the other sections
+    uint32_t printed = changed;
+    if (changed & (1 << UB_SECTION_SS))
+        printed |= (1 << UB_SECTION_AC) | (1 << UB_SECTION_TS);
+
+    // The JSON refers to strings by id, only the changed sections are written
+    if (json != NULL) {
+        reply_put(json, ",\"changed\":[", 12);
+        int first = 1;
+        for (int i = 0; i < ub_section_len; i++) {
+            if (changed & (1 << i)) {
+                reply_printf(json, "%s\"%s\"", first ? "" : ",", section_names[i]);
+                first = 0;
+            }
+        }
+        reply_printf(json, "],\"ms\":%.1f", (clock() - start) * 1000.0 / CLOCKS_PER_SEC);
+        for (int i = 0; i < ub_section_len; i++) {
+            if (changed & (1 << i)) {
+                reply_put(json, ",", 1);
+                json_section(json, entry->doc, i);
+            }
+        }
+        watch_json_flush(json);
+        return;
+    }
+
+    printf("## %s:", entry->path);
+    for (int i = 0; i < ub_section_len; i++)
+        if (changed & (1 << i))
+            printf(" %s", section_names[i]);
+    printf(" changed, %.1f ms\n", (clock() - start) * 1000.0 / CLOCKS_PER_SEC);
+    for (int i = 0; i < ub_section_len; i++)
+        if (printed & (1 << i))
+            print_section(entry->doc, i);
+    fflush(stdout);
+}
+
+// Runs until the process is killed, json writes one line of JSON per change instead of the text dump
+void watch(char** files, int file_count, int json) {
+    if (file_count > MAXIMUM_WAIT_OBJECTS) {
+        printf("Can not watch more than %d files!\n", MAXIMUM_WAIT_OBJECTS);
+        return;
+    }
+
+    struct watch_entry* entries = calloc(file_count, sizeof(struct watch_entry));
+    HANDLE* handles = malloc(sizeof(HANDLE) * (file_count + (size_t)1));
+    int handle_count = 0;
+    struct reply reply = {0};
+
+    // One notification per file, on the directory containing it
+    for (int i = 0; i < file_count; i++) {
+        entries[i].path = files[i];
+        entries[i].json = json ? &reply : NULL;
+
+        char dir[260];
+        const char* slash = strrchr(files[i], '\\');
+        if (strrchr(files[i], '/') > slash)
+            slash = strrchr(files[i], '/');
+        if (slash == NULL || slash - files[i] >= sizeof(dir)) {
+            strcpy(dir, ".");
+        }
+        else {
+            memcpy(dir, files[i], slash - files[i]);
+            dir[slash - files[i]] = 0;
+        }
+
+        HANDLE hChange = FindFirstChangeNotificationA(dir, FALSE,
+            FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE);
+        if (hChange != INVALID_HANDLE_VALUE)
+            handles[handle_count++] = hChange;
+
+        watch_update(entries + i, 1);
+    }
+
+    // Without any notification, the modification times are polled
+    for (;;) {
+        DWORD wait = WAIT_TIMEOUT;
+        if (handle_count > 0)
+            wait = WaitForMultipleObjects(handle_count, handles, FALSE, WATCH_POLL_MS);
+        else
+            Sleep(WATCH_POLL_MS);
+
+        int notified = wait >= WAIT_OBJECT_0 && wait < WAIT_OBJECT_0 + handle_count;
+        if (notified)
+            FindNextChangeNotification(handles[wait - WAIT_OBJECT_0]);
+        for (int i = 0; i < file_count; i++)
+            watch_update(entries + i, notified);
+    }
+}
+
+// Path queries, every query runs in the same pass over each file. Each thread collects its own hits,
+// which are sorted by file, position and query before printing
+struct query_hit {
+    LONG file;
+    uint32_t fpos;
+    uint32_t query;
+};
+
+struct query_worker {
+    struct file_job* job;
+    const struct ub_query_set* set;
+    LONG file;
+    uint32_t hit_count;
+    uint32_t hit_capacity;
+    struct query_hit* hits;
+    uint32_t skipped;
+};
+
+void query_match(void* ctx, uint32_t query, uint32_t fpos) {
+    struct query_worker* worker = ctx;
+    if (worker->hit_count == worker->hit_capacity) {
+        worker->hit_capacity = worker->hit_capacity == 0 ? 256 : worker->hit_capacity * 2;
+        worker->hits = realloc(worker->hits, sizeof(struct query_hit) * worker->hit_capacity);
+    }
+    struct query_hit* hit = worker->hits + worker->hit_count++;
+    hit->file = worker->file;
+    hit->fpos = fpos;
+    hit->query = query;
+}
+
+DWORD WINAPI query_thread(LPVOID param) {
+    struct query_worker* worker = param;
+    struct file_job* job = worker->job;
+
+    for (;;) {
+        LONG i = InterlockedIncrement(&job->next) - 1;
+        if (i >= job->file_count)
+            break;
+
+        FILE* hFile = fopen(job->files[i], "rb");
+        if (hFile == NULL) {
+            worker->skipped++;
+            continue;
+        }
+        struct ub_buf* buf;
+        int r = ub_buf_load(hFile, &buf);
+        fclose(hFile);
+        if (r != UB_OK) {
+            worker->skipped++;
+            continue;
+        }
+
+        worker->file = i;
+        if (ub_query_run(worker->set, buf->data, buf->size, NULL, query_match, worker) != UB_OK)
+            worker->skipped++;
+        ub_free_buf(buf);
+    }
+
+    return 0;
+}
+
+int compare_query_hit(const void* a, const void* b) {
+    const struct query_hit* x = a;
+    const struct query_hit* y = b;
+    if (x->file != y->file)
+        return x->file < y->file ? -1 : 1;
+    if (x->fpos != y->fpos)
+        return x->fpos < y->fpos ? -1 : 1;
+    return x->query < y->query ? -1 : x->query > y->query;
+}
+
+// One query per line, empty lines and lines starting with # are skipped. texts receives the line of each query
+struct ub_query_set* load_queries(const char* query_file, char*** texts) {
+    FILE* hQueries = fopen(query_file, "r");
+    if (hQueries == NULL) {
+        printf("Failed to open the query file!\n");
+        return NULL;
+    }
+
+    struct ub_query_set* set = ub_new_query_set();
+    *texts = NULL;
+    char line[1024];
+    for (int line_no = 1; fgets(line, sizeof(line), hQueries) != NULL; line_no++) {
+        line[strcspn(line, "\r\n")] = 0;
+        if (line[0] == 0 || line[0] == '#')
+            continue;
+
+        uint32_t err_pos;
+        if (ub_query_add(set, line, &err_pos) != UB_OK) {
+            printf("%s:%d: syntax error at column %d\n", query_file, line_no, err_pos + 1);
+            continue;
+        }
+        *texts = realloc(*texts, sizeof(char*) * set->query_count);
+        (*texts)[set->query_count - 1] = malloc(strlen(line) + 1);
+        strcpy((*texts)[set->query_count - 1], line);
+    }
+    fclose(hQueries);
+    return set;
+}
+
+void free_queries(struct ub_query_set* set, char** texts) {
+    for (uint32_t i = 0; i < set->query_count; i++)
+        free(texts[i]);
+    free(texts);
+    ub_free_query_set(set);
+}
+
+void query(const char* query_file, char** files, int file_count) {
+    char** texts;
+    struct ub_query_set* set = load_queries(query_file, &texts);
+    if (set == NULL)
+        return;
+
+    int thread_count = worker_count(file_count);
+    struct file_job job = {files, file_count, 0};
+    struct query_worker* workers = calloc(thread_count, sizeof(struct query_worker));
+    HANDLE* threads = malloc(sizeof(HANDLE) * thread_count);
+    for (int i = 0; i < thread_count; i++) {
+        workers[i].job = &job;
+        workers[i].set = set;
+        threads[i] = CreateThread(NULL, 0, query_thread, workers + i, 0, NULL);
+    }
+    WaitForMultipleObjects(thread_count, threads, TRUE, INFINITE);
+
+    uint32_t hit_count = 0, skipped = 0;
+    for (int i = 0; i < thread_count; i++) {
+        CloseHandle(threads[i]);
+        hit_count += workers[i].hit_count;
+        skipped += workers[i].skipped;
+    }
+    struct query_hit* hits = malloc(sizeof(struct query_hit) * (hit_count + (size_t)1));
+    hit_count = 0;
+    for (int i = 0; i < thread_count; i++) {
+        if (workers[i].hit_count != 0)
+            memcpy(hits + hit_count, workers[i].hits, sizeof(struct query_hit) * workers[i].hit_count);
+        hit_count += workers[i].hit_count;
+        free(workers[i].hits);
+    }
+    qsort(hits, hit_count, sizeof(struct query_hit), compare_query_hit);
+
+    for (uint32_t i = 0; i < hit_count; i++)
+        printf("%s @0x%04X: %s\n", files[hits[i].file], hits[i].fpos, texts[hits[i].query]);
+    printf("# %d matches of %d queries in %d files, %d skipped\n", hit_count, set->query_count, file_count, skipped);
+
+    free(hits);
+    free(threads);
+    free(workers);
+    free_queries(set, texts);
+}
+
+// Carving, the mapped image is split into one chunk per thread
+struct carve_hit {
+    size_t offset;
+    uint32_t size;
+};
+
+struct carve_worker {
+    const uint8_t* data;
+    size_t size;
+    size_t start, end;
+    uint32_t hit_count;
+    uint32_t hit_capacity;
+    struct carve_hit* hits;
+    struct ub_stats* stats;         // NULL if the statistics are not collected
+    struct query_worker query;      // The file of a query hit is the index of the binary in hits
+};
+
+void carve_found(void* ctx, size_t offset, uint32_t bin_size, const uint32_t* bounds) {
+    struct carve_worker* worker = ctx;
+    if (worker->hit_count == worker->hit_capacity) {
+        worker->hit_capacity = worker->hit_capacity == 0 ? 16 : worker->hit_capacity * 2;
+        worker->hits = realloc(worker->hits, sizeof(struct carve_hit) * worker->hit_capacity);
+    }
+    worker->hits[worker->hit_count].offset = offset;
+    worker->hits[worker->hit_count].size = bin_size;
+    worker->hit_count++;
+
+    // The binary is read in place in the mapped image, ub_carve has already validated it
+    if (worker->stats != NULL)
+        ub_stats_add(worker->stats, worker->data + offset, bin_size, bounds);
+    if (worker->query.set != NULL) {
+        worker->query.file = worker->hit_count - 1;
+        ub_query_run(worker->query.set, worker->data + offset, bin_size, bounds, query_match, &worker->query);
+    }
+}
+
+DWORD WINAPI carve_thread(LPVOID param) {
+    struct carve_worker* worker = param;
+    ub_carve(worker->data, worker->size, worker->start, worker->end, carve_found, worker);
+    return 0;
+}
+
+// Writes each binary found to <prefix>_<offset>.bin if prefix is not NULL. The binaries found are added to stats
+// if it is not NULL, and the queries of set run over them if it is not NULL
+void carve(const char* filename, const char* prefix, struct ub_stats* stats, const struct ub_query_set* set, char** texts) {
+    HANDLE hFile = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) {
+        printf("Failed to open the image!\n");
+        return;
+    }
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(hFile, &file_size) || file_size.QuadPart == 0 || (uint64_t)file_size.QuadPart > SIZE_MAX) {
+        printf("Can not map the image!\n");
+        CloseHandle(hFile);
+        return;
+    }
+    size_t size = (size_t)file_size.QuadPart;
+
+    HANDLE hMapping = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    const uint8_t* data = hMapping == NULL ? NULL : MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+    if (data == NULL) {
+        printf("Can not map the image!\n");
+        if (hMapping != NULL)
+            CloseHandle(hMapping);
+        CloseHandle(hFile);
+        return;
+    }
+
+    int thread_count = worker_count(MAXIMUM_WAIT_OBJECTS);
+
+    struct carve_worker* workers = calloc(thread_count, sizeof(struct carve_worker));
+    HANDLE* threads = malloc(sizeof(HANDLE) * thread_count);
+    size_t chunk = size / thread_count + 1;
+    for (int i = 0; i < thread_count; i++) {
+        workers[i].data = data;
+        workers[i].size = size;
+        workers[i].start = chunk * i;
+        workers[i].end = chunk * (i + 1);
+        workers[i].stats = stats == NULL ? NULL : ub_new_stats();
+        workers[i].query.set = set;
+        threads[i] = CreateThread(NULL, 0, carve_thread, workers + i, 0, NULL);
+    }
+    WaitForMultipleObjects(thread_count, threads, TRUE, INFINITE);
+
+    // Chunks are in order, so are the hits. The query hits of each chunk are sorted by binary and position
+    uint32_t count = 0, match_count = 0;
+    for (int i = 0; i < thread_count; i++) {
+        CloseHandle(threads[i]);
+        struct query_worker* query = &workers[i].query;
+        if (query->hit_count != 0)
+            qsort(query->hits, query->hit_count, sizeof(struct query_hit), compare_query_hit);
+        uint32_t k = 0;
+
+        for (uint32_t j = 0; j < workers[i].hit_count; j++) {
+            struct carve_hit* hit = workers[i].hits + j;
+            printf("@0x%08llX: %d bytes\n", (unsigned long long)hit->offset, hit->size);
+            count++;
+            for (; k < query->hit_count && query->hits[k].file == (LONG)j; k++, match_count++)
+                printf("@0x%08llX: %s\n", (unsigned long long)(hit->offset + query->hits[k].fpos), texts[query->hits[k].query]);
+
+            if (prefix != NULL) {
+                char out_name[1024];
+                snprintf(out_name, sizeof(out_name), "%s_%08llX.bin", prefix, (unsigned long long)hit->offset);
+                FILE* hOut = fopen(out_name, "wb");
+                if (hOut == NULL || fwrite(data + hit->offset, 1, hit->size, hOut) != hit->size)
+                    printf("Failed to write %s!\n", out_name);
+                if (hOut != NULL)
+                    fclose(hOut);
+            }
+        }
+        free(workers[i].hits);
+        free(query->hits);
+        if (stats != NULL) {
+            ub_stats_merge(stats, workers[i].stats);
+            ub_free_stats(workers[i].stats);
+        }
+    }
+    printf("%d binaries found\n", count);
+    if (set != NULL)
+        printf("# %d matches of %d queries\n", match_count, set->query_count);
+
+    free(threads);
+    free(workers);
+    UnmapViewOfFile(data);
+    CloseHandle(hMapping);
+    CloseHandle(hFile);
 }
 
 int main(int argc, char** argv)
@@ -209,6 +1586,107 @@ int main(int argc, char** argv)
         exit(EXIT_FAILURE);
     }
 
+    if (strcmp(argv[1], "-r") == 0) {
+        resident(argc > 2 ? argv[2] : SERVER_PIPE_NAME);
+        exit(EXIT_SUCCESS);
+    }
+
+    if (strcmp(argv[1], "-c") == 0) {
+        if (argc < 3) {
+            printf("Need input file!\n");
+            exit(EXIT_FAILURE);
+        }
+
+        // -c <image> -s or -c <image> -q <queries> reads the binaries found in place, instead of writing them
+        if (argc > 3 && strcmp(argv[3], "-s") == 0) {
+            struct ub_stats* total = ub_new_stats();
+            carve(argv[2], NULL, total, NULL, NULL);
+            print_stats(total);
+            ub_free_stats(total);
+        }
+        else if (argc > 3 && strcmp(argv[3], "-q") == 0) {
+            if (argc < 5) {
+                printf("Need query file!\n");
+                exit(EXIT_FAILURE);
+            }
+            char** texts;
+            struct ub_query_set* set = load_queries(argv[4], &texts);
+            if (set == NULL)
+                exit(EXIT_FAILURE);
+            carve(argv[2], NULL, NULL, set, texts);
+            free_queries(set, texts);
+        }
+        else {
+            carve(argv[2], argc > 3 ? argv[3] : NULL, NULL, NULL, NULL);
+        }
+        exit(EXIT_SUCCESS);
+    }
+
+    if (strcmp(argv[1], "-e") == 0) {
+        if (argc < 3) {
+            printf("Need output file!\n");
+            exit(EXIT_FAILURE);
+        }
+        export_columns(argv[2], argv + 3, argc - 3);
+        exit(EXIT_SUCCESS);
+    }
+
+    if (strcmp(argv[1], "-i") == 0) {
+        if (argc < 3) {
+            printf("Need input file!\n");
+            exit(EXIT_FAILURE);
+        }
+        print_columns(argv[2]);
+        exit(EXIT_SUCCESS);
+    }
+
+    if (strcmp(argv[1], "-q") == 0) {
+        if (argc < 3) {
+            printf("Need query file!\n");
+            exit(EXIT_FAILURE);
+        }
+        query(argv[2], argv + 3, argc - 3);
+        exit(EXIT_SUCCESS);
+    }
+
+    if (strcmp(argv[1], "-s") == 0) {
+        stats(argv + 2, argc - 2);
+        exit(EXIT_SUCCESS);
+    }
+
+    if (strcmp(argv[1], "-w") == 0) {
+        int json = argc > 2 && strcmp(argv[2], "-j") == 0;
+        watch(argv + 2 + json, argc - 2 - json, json);
+        exit(EXIT_FAILURE);
+    }
+
+    if (strcmp(argv[1], "-x") == 0) {
+        FILE* hFile = argc < 3 ? NULL : fopen(argv[2], "rb");
+        if (hFile == NULL) {
+            printf("Failed to open the UICC bml file!\n");
+            exit(EXIT_FAILURE);
+        }
+        int r = xaml(hFile);
+        fclose(hFile);
+        exit(r == UB_OK ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    if (strcmp(argv[1], "-p") == 0) {
+        if (argc < 7) {
+            printf("Need input file, offset, old length, hex bytes and output file!\n");
+            exit(EXIT_FAILURE);
+        }
+        int r = splice(argv[2], strtoul(argv[3], NULL, 0), strtoul(argv[4], NULL, 0), argv[5], argv[6]);
+        exit(r == UB_OK ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    if (strcmp(argv[1], "-v") == 0) {
+        uint32_t count = 0;
+        for (int i = 2; i < argc; i++)
+            count += validate(argv[i]);
+        exit(count == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
     char* filename = argv[1];
     FILE* hFile = fopen(filename, "rb");
     if (hFile == NULL) {
@@ -0,0 +1,336 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "uicc_bml.h"
+
+// Offset of the file size DWORD, right after the header magic number
+#define FILE_SIZE_OFFSET 0x0E
+// Each entry in the pointer section: DWORD id, WORD index, DWORD address
+#define PS_ENTRY_LEN 10
+
+static void put_word(uint8_t* ptr, uint16_t value) {
+    ptr[0] = value & 0xFF;
+    ptr[1] = (value >> 8) & 0xFF;
+}
+
+static void put_dword(uint8_t* ptr, uint32_t value) {
+    ptr[0] = value & 0xFF;
+    ptr[1] = (value >> 8) & 0xFF;
+    ptr[2] = (value >> 16) & 0xFF;
+    ptr[3] = (value >> 24) & 0xFF;
+}
+
+int ub_buf_load(FILE* hFile, struct ub_buf** ret) {
+    *ret = 0;
+
+    if (fseek(hFile, 0, SEEK_END) != 0)
+        return UB_ERRMSG(UB_SRC_FILE, UB_MSG_FAILED_UNKNOWN);
+    long size = ftell(hFile);
+    if (size < 0 || fseek(hFile, 0, SEEK_SET) != 0)
+        return UB_ERRMSG(UB_SRC_FILE, UB_MSG_FAILED_UNKNOWN);
+
+    struct ub_buf* buf = malloc(sizeof(struct ub_buf));
+    buf->size = size;
+    buf->capacity = size;
+    buf->data = malloc(size + (size_t)1);
+    if (fread(buf->data, 1, size, hFile) != (size_t)size) {
+        ub_free_buf(buf);
+        return UB_ERRMSG(UB_SRC_FILE, UB_MSG_INVALID_LENGTH);
+    }
+
+    *ret = buf;
+    return UB_OK;
+}
+
+int ub_buf_save(struct ub_buf* buf, FILE* hFile) {
+    if (fwrite(buf->data, 1, buf->size, hFile) != buf->size)
+        return UB_ERRMSG(UB_SRC_FILE, UB_MSG_FAILED_UNKNOWN);
+    return UB_OK;
+}
+
+void ub_free_buf(struct ub_buf* buf) {
+    free(buf->data);
+    free(buf);
+}
+
+int ub_patch_ac_pair(struct ub_buf* buf, struct ub_ac_pair* pair, uint32_t value, uint32_t auxdata) {
+    if (pair->fpos + 5 > buf->size)
+        return UB_ERRMSG(UB_SRC_AC, UB_MSG_INVALID_LENGTH);
+
+    put_dword(buf->data + pair->fpos + 1, value);
+    pair->value = value;
+
+    // Image ids carry the DPI as a third WORD
+    if (pair->type >= 0x03 && pair->type <= 0x06) {
+        if (pair->fpos + 7 > buf->size)
+            return UB_ERRMSG(UB_SRC_AC, UB_MSG_INVALID_LENGTH);
+        put_word(buf->data + pair->fpos + 5, auxdata);
+        pair->auxdata = auxdata;
+    }
+
+    return UB_OK;
+}
+
+int ub_patch_ts_prop(struct ub_buf* buf, struct ub_ts_prop* prop, uint32_t data) {
+    int len = ub_ts_prop_len(prop);
+    if (len > 4 || prop->fpos + 4 + len > buf->size)
+        return UB_ERRMSG(UB_SRC_TS, UB_MSG_INVALID_LENGTH);
+    // The value must fit in the payload, so that prop->data stays the same as the bytes written
+    if (len < 4 && (data >> (len * 8)) != 0)
+        return UB_ERRMSG(UB_SRC_TS, UB_MSG_INVALID_LENGTH);
+
+    uint8_t* ptr = buf->data + prop->fpos + 4;
+    for (int i = 0; i < len; i++)
+        ptr[i] = (data >> (i * 8)) & 0xFF;
+    prop->data = data;
+
+    return UB_OK;
+}
+
+// Returns 1 if the edit [offset, end) cuts through the tag [start, stop): it must cover the whole tag,
+// lie within it behind its first byte, or miss it
+static int ub_splice_straddles(uint32_t start, uint32_t stop, uint32_t offset, uint32_t end) {
+    if (offset >= stop || end <= start)
+        return 0;
+    return !(offset <= start && end >= stop) && !(offset > start && end <= stop);
+}
+
+// Returns 0 if the edit cuts through a node, collection or supplementary block,
+// or if one enclosing it would overflow its WORD length
+static int ub_splice_check_tag(struct ub_buf* buf, void* tag, uint32_t limit, uint32_t offset, uint32_t end, int32_t delta) {
+    if (tag == NULL)
+        return 1;
+
+    enum ub_ts_type tag_type = *((enum ub_ts_type*)tag);
+    if (tag_type == UB_TST_NODE) {
+        struct ub_ts_node* node = tag;
+        if (ub_splice_straddles(node->fpos, node->fpos + node->length, offset, end))
+            return 0;
+        if (offset > node->fpos && offset < node->fpos + node->length &&
+            (int32_t)node->length + delta > 0xFFFF)
+            return 0;
+        for (int i = 0; i < node->child_count; i++)
+            if (!ub_splice_check_tag(buf, node->child_ptrs[i], limit, offset, end, delta))
+                return 0;
+    }
+    else if (tag_type == UB_TST_COLLECTION) {
+        struct ub_ts_collection* coll = tag;
+        // A collection has no length, an unknown end is taken as running up to limit
+        uint32_t stop = ub_ts_tag_end(buf->data, coll->fpos, limit);
+        if (ub_splice_straddles(coll->fpos, stop != 0 ? stop : limit, offset, end))
+            return 0;
+        for (int i = 0; i < coll->child_count; i++)
+            if (!ub_splice_check_tag(buf, coll->child_ptrs[i], limit, offset, end, delta))
+                return 0;
+    }
+    else if (tag_type == UB_TST_POINTER) {
+        struct ub_ts_pointer* pointer = tag;
+        if (pointer->target_coll != NULL) {
+            uint32_t block_addr = pointer->target_addr;
+            uint16_t block_len = ub_buf_word(buf->data + block_addr);
+            if (ub_splice_straddles(block_addr, block_addr + block_len, offset, end))
+                return 0;
+            if (offset > block_addr && offset < block_addr + block_len && (int32_t)block_len + delta > 0xFFFF)
+                return 0;
+        }
+        return ub_splice_check_tag(buf, pointer->target_coll, limit, offset, end, delta);
+    }
+
+    return 1;
+}
+
+// Runs before the tail is moved, so every write goes to the old position.
+// end is the first byte behind the replaced range
+static void ub_splice_fix_tag(struct ub_buf* buf, void* tag, uint32_t offset, uint32_t end, int32_t delta) {
+    if (tag == NULL)
+        return;
+
+    enum ub_ts_type tag_type = *((enum ub_ts_type*)tag);
+    if (tag_type == UB_TST_NODE) {
+        struct ub_ts_node* node = tag;
+        if (offset > node->fpos && offset < node->fpos + node->length) {
+            node->length += delta;
+            put_word(buf->data + node->fpos + 5, node->length);
+        }
+        if (node->fpos >= end)
+            node->fpos += delta;
+
+        for (int i = 0; i < node->child_count; i++)
+            ub_splice_fix_tag(buf, node->child_ptrs[i], offset, end, delta);
+    }
+    else if (tag_type == UB_TST_COLLECTION) {
+        struct ub_ts_collection* coll = tag;
+        if (coll->fpos >= end)
+            coll->fpos += delta;
+
+        for (int i = 0; i < coll->child_count; i++)
+            ub_splice_fix_tag(buf, coll->child_ptrs[i], offset, end, delta);
+    }
+    else if (tag_type == UB_TST_PROP) {
+        struct ub_ts_prop* prop = tag;
+        if (prop->fpos >= end)
+            prop->fpos += delta;
+    }
+    else if (tag_type == UB_TST_POINTER) {
+        struct ub_ts_pointer* pointer = tag;
+        if (pointer->target_addr >= end) {
+            pointer->target_addr += delta;
+            put_dword(buf->data + pointer->fpos + 1, pointer->target_addr);
+        }
+        if (pointer->fpos >= end)
+            pointer->fpos += delta;
+
+        ub_splice_fix_tag(buf, pointer->target_coll, offset, end, delta);
+    }
+}
+
+static int compare_addr(const void* a, const void* b) {
+    uint32_t addr_a = *(const uint32_t*)a, addr_b = *(const uint32_t*)b;
+    return addr_a < addr_b ? -1 : addr_a > addr_b;
+}
+
+// The supplementary block starts with its own WORD length. Several pointers can lead to the same block,
+// each with its own copy of the tags, so the addresses of the enclosing blocks are collected and fixed once
+static int ub_splice_fix_blocks(struct ub_buf* buf, struct ub_doc* doc, uint32_t offset, int32_t delta) {
+    uint32_t* addrs = malloc(sizeof(uint32_t) * (doc->pointer_count + (size_t)1));
+    if (addrs == NULL)
+        return UB_FAILED;
+
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < doc->pointer_count; i++) {
+        struct ub_ts_pointer* pointer = doc->pointers[i];
+        uint32_t block_addr = pointer->target_addr;
+        if (pointer->target_coll != NULL && offset > block_addr && offset < block_addr + ub_buf_word(buf->data + block_addr))
+            addrs[count++] = block_addr;
+    }
+    qsort(addrs, count, sizeof(uint32_t), compare_addr);
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (i > 0 && addrs[i] == addrs[i - 1])
+            continue;
+        put_word(buf->data + addrs[i], ub_buf_word(buf->data + addrs[i]) + delta);
+    }
+
+    free(addrs);
+    return UB_OK;
+}
+
+int ub_splice(struct ub_buf* buf, struct ub_doc* doc, uint32_t offset, uint32_t old_len, const void* data, uint32_t new_len) {
+    uint32_t end = offset + old_len;
+    int32_t delta = (int32_t)new_len - (int32_t)old_len;
+
+    // The header and the pointer section can not be edited
+    if (offset < FILE_SIZE_OFFSET + 4 || end < offset || end > doc->ps_offset || doc->ps_offset + 4 > buf->size)
+        return UB_ERRMSG(UB_SRC_FILE, UB_MSG_INVALID_LENGTH);
+
+    // Every tag enclosing the edit point is found by walking the whole tree
+    if (!ub_splice_check_tag(buf, doc->root, doc->ps_offset, offset, end, delta))
+        return UB_ERRMSG(UB_SRC_TS, UB_MSG_INVALID_LENGTH);
+
+    if (delta == 0) {
+        memcpy(buf->data + offset, data, new_len);
+        return UB_OK;
+    }
+
+    if (buf->size + delta > buf->capacity) {
+        uint32_t capacity = (buf->size + delta) * 2;
+        uint8_t* new_data = realloc(buf->data, capacity);
+        if (new_data == NULL)
+            return UB_FAILED;
+        buf->data = new_data;
+        buf->capacity = capacity;
+    }
+
+    // Allocates, so it goes before anything else is changed
+    int r = ub_splice_fix_blocks(buf, doc, offset, delta);
+    if (r != UB_OK)
+        return r;
+
+    // Lengths of the enclosing sections
+    struct ub_uss* uss = doc->uss;
+    if (offset > uss->fpos && offset < uss->fpos + uss->length) {
+        uss->length += delta;
+        put_dword(buf->data + uss->fpos + 1, uss->length);
+    }
+
+    struct ub_ss* ss = doc->ss;
+    if (offset > ss->fpos && offset < ss->fpos + ss->length) {
+        ss->length += delta;
+        put_dword(buf->data + ss->fpos + 1, ss->length);
+    }
+
+    if (offset > doc->supp_fpos && offset < doc->ps_offset) {
+        uint32_t supp_len = ub_buf_dword(buf->data + doc->supp_fpos);
+        put_dword(buf->data + doc->supp_fpos, supp_len + delta);
+    }
+
+    // Addresses in the pointer section
+    uint32_t ps_end = doc->ps_offset + ub_buf_dword(buf->data + doc->ps_offset);
+    if (ps_end > buf->size)
+        ps_end = buf->size;
+    for (uint32_t pos = doc->ps_offset + 4; pos + PS_ENTRY_LEN <= ps_end; pos += PS_ENTRY_LEN) {
+        uint32_t addr = ub_buf_dword(buf->data + pos + 6);
+        if (addr >= end)
+            put_dword(buf->data + pos + 6, addr + delta);
+    }
+
+    // Node lengths and pointers within the tree, the tags of supplementary blocks are reached via the pointers
+    ub_splice_fix_tag(buf, doc->root, offset, end, delta);
+
+    for (uint32_t i = 0; i < doc->ac->count; i++) {
+        struct ub_ac_tag* tag = doc->ac->tags[i];
+        for (int j = 0; j < tag->count; j++) {
+            if (tag->properties[j]->fpos >= end)
+                tag->properties[j]->fpos += delta;
+        }
+    }
+
+    for (uint32_t i = 0; i < ss->count; i++) {
+        if (ss->strings[i]->fpos >= end)
+            ss->strings[i]->fpos += delta;
+    }
+    if (ss->fpos >= end)
+        ss->fpos += delta;
+
+    doc->ps_offset += delta;
+    put_dword(buf->data + doc->ts_fpos + 3, doc->ps_offset);
+    if (doc->ts_fpos >= end)
+        doc->ts_fpos += delta;
+    if (doc->supp_fpos >= end)
+        doc->supp_fpos += delta;
+
+    doc->size += delta;
+    put_dword(buf->data + FILE_SIZE_OFFSET, doc->size);
+
+    // Finally move the tail and copy the new bytes in
+    memmove(buf->data + offset + new_len, buf->data + end, buf->size - end);
+    memcpy(buf->data + offset, data, new_len);
+    buf->size += delta;
+
+    return UB_OK;
+}
+
+int ub_patch_ss_string(struct ub_buf* buf, struct ub_doc* doc, uint32_t index, const uint16_t* wchars, uint16_t length) {
+    if (index >= doc->ss->count)
+        return UB_ERRMSG(UB_SRC_SS, UB_MSG_INVALID_LENGTH);
+
+    // Replace the WORD length and the WideChars
+    struct ub_ss_string* ss_string = doc->ss->strings[index];
+    uint8_t* bin = malloc(length + (size_t)2);
+    put_word(bin, length);
+    memcpy(bin + 2, wchars, length);
+    int r = ub_splice(buf, doc, ss_string->fpos + 8, ss_string->length + 2, bin, length + 2);
+    free(bin);
+    if (r != UB_OK)
+        return r;
+
+    ss_string = realloc(ss_string, sizeof(struct ub_ss_string) + length + 2);
+    ss_string->length = length;
+    ss_string->wchars = (uint16_t*)(ss_string + 1);
+    memcpy(ss_string->wchars, wchars, length);
+    ss_string->wchars[length >> 1] = 0x0000;
+    doc->ss->strings[index] = ss_string;
+
+    return UB_OK;
+}
@@ -0,0 +1,445 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "uicc_bml.h"
+
+// Query compiler
+
+static const char* q_space(const char* p) {
+    while (*p == ' ' || *p == '\t')
+        p++;
+    return p;
+}
+
+static int q_hex(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+// Decimal, or hexadecimal after 0x. A leading 0 is not octal, [id=010] is 10
+static const char* q_number(const char* p, uint32_t* value) {
+    int base = 10;
+    if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+        base = 16;
+        p += 2;
+    }
+
+    const char* start = p;
+    uint64_t v = 0;
+    for (int digit; (digit = q_hex(*p)) >= 0 && digit < base; p++) {
+        v = v * base + digit;
+        if (v > 0xFFFFFFFF)
+            return NULL;
+    }
+    if (p == start)
+        return NULL;
+    *value = (uint32_t)v;
+    return p;
+}
+
+// UTF-8 between single quotes to UTF-16LE, returns NULL on a malformed string
+static const char* q_string(const char* p, struct ub_query_pred* pred) {
+    const char* end = strchr(p, '\'');
+    if (end == NULL)
+        return NULL;
+
+    pred->name = malloc((end - p) * 2 + (size_t)4);
+    uint32_t len = 0;
+    while (p < end) {
+        uint32_t c = (uint8_t)*p;
+        int extra = c < 0x80 ? 0 : c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : c >= 0xC0 ? 1 : -1;
+        if (extra < 0 || p + extra >= end)
+            return NULL;
+        if (extra > 0)
+            c &= 0x3F >> extra;
+        for (int i = 1; i <= extra; i++) {
+            if ((p[i] & 0xC0) != 0x80)
+                return NULL;
+            c = (c << 6) | (p[i] & 0x3F);
+        }
+        p += 1 + extra;
+
+        if (c >= 0x10000) {
+            c -= 0x10000;
+            uint32_t high = 0xD800 + (c >> 10), low = 0xDC00 + (c & 0x3FF);
+            pred->name[len++] = high & 0xFF;
+            pred->name[len++] = high >> 8;
+            pred->name[len++] = low & 0xFF;
+            pred->name[len++] = low >> 8;
+        }
+        else {
+            pred->name[len++] = c & 0xFF;
+            pred->name[len++] = c >> 8;
+        }
+    }
+    pred->name_len = len;
+    return end + 1;
+}
+
+static const char* q_op(const char* p, uint8_t* op) {
+    if (p[0] == '!' && p[1] == '=') { *op = UB_QOP_NE; return p + 2; }
+    if (p[0] == '<' && p[1] == '=') { *op = UB_QOP_LE; return p + 2; }
+    if (p[0] == '>' && p[1] == '=') { *op = UB_QOP_GE; return p + 2; }
+    if (p[0] == '=') { *op = UB_QOP_EQ; return p + 1; }
+    if (p[0] == '<') { *op = UB_QOP_LT; return p + 1; }
+    if (p[0] == '>') { *op = UB_QOP_GT; return p + 1; }
+    return NULL;
+}
+
+// pred := "@" (hex4 | hex6) [op number] | ("type" | "count" | "id") op number | "name" ("=" | "!=") 'string'
+static const char* q_pred(const char* p, struct ub_query_pred* pred) {
+    if (*p == '@') {
+        int hex[6], digits = 0;
+        while (digits < 6 && (hex[digits] = q_hex(p[1 + digits])) >= 0)
+            digits++;
+        if (digits != 4 && digits != 6)
+            return NULL;
+        pred->key = digits == 6 ? UB_QKEY_PROP : UB_QKEY_PROP_ANY_LEN;
+        pred->b1 = (hex[0] << 4) | hex[1];
+        pred->b2 = (hex[2] << 4) | hex[3];
+        pred->b3 = digits == 6 ? (hex[4] << 4) | hex[5] : 0;
+        p = q_space(p + 1 + digits);
+        if (*p == ']') {
+            pred->op = UB_QOP_EXISTS;
+            return p;
+        }
+        p = q_op(p, &pred->op);
+        return p == NULL ? NULL : q_number(q_space(p), &pred->value);
+    }
+
+    if (strncmp(p, "name", 4) == 0) {
+        pred->key = UB_QKEY_NAME;
+        p = q_op(q_space(p + 4), &pred->op);
+        if (p == NULL || (pred->op != UB_QOP_EQ && pred->op != UB_QOP_NE))
+            return NULL;
+        p = q_space(p);
+        return *p == '\'' ? q_string(p + 1, pred) : NULL;
+    }
+
+    if (strncmp(p, "type", 4) == 0)
+        pred->key = UB_QKEY_TYPE;
+    else if (strncmp(p, "count", 5) == 0)
+        pred->key = UB_QKEY_COUNT;
+    else if (strncmp(p, "id", 2) == 0)
+        pred->key = UB_QKEY_ID;
+    else
+        return NULL;
+    p += pred->key == UB_QKEY_COUNT ? 5 : pred->key == UB_QKEY_ID ? 2 : 4;
+
+    p = q_op(q_space(p), &pred->op);
+    return p == NULL ? NULL : q_number(q_space(p), &pred->value);
+}
+
+// test := "*" | "Node" | "Collection" | element name | object type
+static const char* q_test(const char* p, struct ub_query_step* step) {
+    if (*p == '*') {
+        step->test = UB_QTEST_ANY;
+        return p + 1;
+    }
+    if (*p >= '0' && *p <= '9') {
+        uint32_t type;
+        p = q_number(p, &type);
+        if (p == NULL || type > 0xFFFF)
+            return NULL;
+        step->test = UB_QTEST_NODE_TYPE;
+        step->type = type;
+        return p;
+    }
+
+    size_t len = 0;
+    while ((p[len] >= 'A' && p[len] <= 'Z') || (p[len] >= 'a' && p[len] <= 'z'))
+        len++;
+    if (len == 4 && strncmp(p, "Node", 4) == 0) {
+        step->test = UB_QTEST_NODE;
+        return p + len;
+    }
+    if (len == 10 && strncmp(p, "Collection", 10) == 0) {
+        step->test = UB_QTEST_COLLECTION;
+        return p + len;
+    }
+    int type = ub_obj_type_from_element(p, len);
+    if (type < 0)
+        return NULL;
+    step->test = UB_QTEST_ELEMENT;
+    step->type = type;
+    return p + len;
+}
+
+struct ub_query_set* ub_new_query_set(void) {
+    return calloc(1, sizeof(struct ub_query_set));
+}
+
+// query := step {step}, step := ("/" | "//") test {"[" pred "]"}
+int ub_query_add(struct ub_query_set* set, const char* query, uint32_t* err_pos) {
+    uint32_t first = set->step_count;
+    const char* p = q_space(query);
+    const char* at = p;         // Start of the last token, where a syntax error is reported
+
+    while (p != NULL && *p != 0) {
+        if (set->step_count == set->step_capacity) {
+            set->step_capacity = set->step_capacity == 0 ? 16 : set->step_capacity * 2;
+            set->steps = realloc(set->steps, sizeof(struct ub_query_step) * set->step_capacity);
+        }
+        struct ub_query_step* step = set->steps + set->step_count;
+        memset(step, 0, sizeof(struct ub_query_step));
+        step->query = set->query_count;
+        set->step_count++;
+
+        if (*p != '/') {
+            p = NULL;
+            break;
+        }
+        step->descendant = p[1] == '/';
+        at = q_space(p + 1 + step->descendant);
+        p = q_test(at, step);
+
+        while (p != NULL && *(p = q_space(p)) == '[') {
+            at = q_space(p + 1);
+            if (step->pred_count == UB_QUERY_MAX_PREDS) {
+                p = NULL;
+                break;
+            }
+            p = q_pred(at, step->preds + step->pred_count++);
+            if (p != NULL) {
+                at = p = q_space(p);
+                p = *p == ']' ? p + 1 : NULL;
+            }
+        }
+        if (p != NULL)
+            at = p;
+    }
+
+    if (p == NULL || set->step_count == first) {
+        if (err_pos != NULL)
+            *err_pos = (uint32_t)(at - query);
+        while (set->step_count > first) {
+            struct ub_query_step* step = set->steps + --set->step_count;
+            for (int i = 0; i < UB_QUERY_MAX_PREDS; i++)
+                free(step->preds[i].name);
+        }
+        return UB_ERRMSG(UB_SRC_UNKNOWN, UB_MSG_INVALID_FORMAT);
+    }
+
+    for (uint32_t i = first; i < set->step_count; i++) {
+        for (int j = 0; j < set->steps[i].pred_count; j++)
+            if (set->steps[i].preds[j].key == UB_QKEY_NAME)
+                set->has_names = 1;
+    }
+    set->steps[set->step_count - 1].last = 1;
+    set->query_count++;
+    return UB_OK;
+}
+
+void ub_free_query_set(struct ub_query_set* set) {
+    for (uint32_t i = 0; i < set->step_count; i++)
+        for (int j = 0; j < UB_QUERY_MAX_PREDS; j++)
+            free(set->steps[i].preds[j].name);
+    free(set->steps);
+    free(set);
+}
+
+// Evaluation, over the binary in memory without parsing it
+
+struct q_run {
+    const struct ub_query_set* set;
+    const uint8_t* data;
+    uint32_t words;             // Length of a state set in uint64_t, one bit per step
+    uint64_t* sets;             // The state set of each depth
+    uint32_t ss_mask;
+    uint32_t* ss_index;         // Hash table of string ids, position of the string + 1
+    void (*match)(void* ctx, uint32_t query, uint32_t fpos);
+    void* ctx;
+};
+
+static uint32_t q_payload(const uint8_t* data, uint32_t pos) {
+    return ub_ts_payload(data + pos + 4, ub_ts_prop_len_from_bin(data[pos + 1], data[pos + 2], data[pos + 3]));
+}
+
+static int q_compare(uint8_t op, uint32_t a, uint32_t b) {
+    switch (op) {
+    case UB_QOP_EQ: return a == b;
+    case UB_QOP_NE: return a != b;
+    case UB_QOP_LT: return a < b;
+    case UB_QOP_GT: return a > b;
+    case UB_QOP_LE: return a <= b;
+    case UB_QOP_GE: return a >= b;
+    }
+    return 1;
+}
+
+static int q_name_equals(struct q_run* run, uint32_t id, const struct ub_query_pred* pred) {
+    if (id > 0xFFFF)
+        return 0;
+    for (uint32_t slot = ub_ss_hash(id) & run->ss_mask; run->ss_index[slot] != 0; slot = (slot + 1) & run->ss_mask) {
+        const uint8_t* ss_string = run->data + run->ss_index[slot] - 1;
+        if (ub_buf_word(ss_string) == id)
+            return ub_buf_word(ss_string + 8) == pred->name_len && memcmp(ss_string + 10, pred->name, pred->name_len) == 0;
+    }
+    return 0;
+}
+
+static int q_pred_matches(struct q_run* run, uint32_t pos, const struct ub_query_pred* pred) {
+    const uint8_t* data = run->data;
+    int is_node = data[pos] == UB_TST_NODE;
+
+    if (pred->key == UB_QKEY_TYPE)
+        return q_compare(pred->op, is_node ? ub_buf_word(data + pos + 1) : data[pos + 2], pred->value);
+    if (pred->key == UB_QKEY_COUNT)
+        return q_compare(pred->op, is_node ? data[pos + 7] : ub_buf_word(data + pos + 3), pred->value);
+    if (!is_node)
+        return 0;
+
+    // Properties are direct children of the node
+    uint32_t node_end = pos + ub_buf_word(data + pos + 5);
+    uint32_t child = pos + 8;
+    for (int i = 0; i < data[pos + 7] && child != 0; i++, child = ub_ts_tag_end(data, child, node_end)) {
+        if (data[child] != UB_TST_PROP)
+            continue;
+        uint8_t b1 = data[child + 1], b2 = data[child + 2], b3 = data[child + 3];
+
+        if (pred->key == UB_QKEY_PROP || pred->key == UB_QKEY_PROP_ANY_LEN) {
+            if (b1 == pred->b1 && b2 == pred->b2 && (b3 == pred->b3 || pred->key == UB_QKEY_PROP_ANY_LEN) &&
+                (pred->op == UB_QOP_EXISTS || q_compare(pred->op, q_payload(data, child), pred->value)))
+                return 1;
+        }
+        else if (b1 == 0x01 && b2 == 0x00 && b3 >= 0x02 && b3 <= 0x04) {
+            // Referring Id
+            uint32_t id = q_payload(data, child);
+            if (pred->key == UB_QKEY_ID)
+                return q_compare(pred->op, id, pred->value);
+            return q_name_equals(run, id, pred) == (pred->op == UB_QOP_EQ);
+        }
+    }
+
+    return 0;
+}
+
+static int q_step_matches(struct q_run* run, uint32_t pos, const struct ub_query_step* step) {
+    const uint8_t* data = run->data;
+
+    switch (step->test) {
+    case UB_QTEST_NODE:
+        if (data[pos] != UB_TST_NODE)
+            return 0;
+        break;
+    case UB_QTEST_NODE_TYPE:
+    case UB_QTEST_ELEMENT:
+        if (data[pos] != UB_TST_NODE || ub_buf_word(data + pos + 1) != step->type)
+            return 0;
+        break;
+    case UB_QTEST_COLLECTION:
+        if (data[pos] != UB_TST_COLLECTION)
+            return 0;
+        break;
+    }
+
+    for (int i = 0; i < step->pred_count; i++) {
+        if (!q_pred_matches(run, pos, step->preds + i))
+            return 0;
+    }
+    return 1;
+}
+
+// Moves every state of the set at depth over the node or collection at pos,
+// returns 0 if no state is left for its children, which are then skipped
+static int q_enter(void* ctx, const uint8_t* data, uint32_t pos, int depth) {
+    struct q_run* run = ctx;
+    const uint64_t* set = run->sets + depth * run->words;
+    uint64_t* next = run->sets + (depth + 1) * run->words;
+    uint64_t live = 0;
+
+    int in_markup = data[pos] == UB_TST_NODE && ub_obj_type_element(ub_buf_word(data + pos + 1)) != NULL;
+
+    memset(next, 0, sizeof(uint64_t) * run->words);
+    for (uint32_t i = 0; i < run->set->step_count; i++) {
+        if (set[i >> 6] == 0) {
+            i |= 63;
+            continue;
+        }
+        if (!(set[i >> 6] & (1ull << (i & 63))))
+            continue;
+
+        // A step that can only match a node looks through a collection, like through a pointer.
+        // An element name also looks through the nodes which are not in the Ribbon markup, as -x writes them
+        const struct ub_query_step* step = run->set->steps + i;
+        int transparent = step->test == UB_QTEST_ELEMENT ? !in_markup :
+            step->test == UB_QTEST_NODE || step->test == UB_QTEST_NODE_TYPE ? data[pos] == UB_TST_COLLECTION : 0;
+        if (step->descendant || transparent)
+            next[i >> 6] |= 1ull << (i & 63);
+        if (q_step_matches(run, pos, step)) {
+            if (step->last)
+                run->match(run->ctx, step->query, pos);
+            else
+                next[(i + 1) >> 6] |= 1ull << ((i + 1) & 63);
+        }
+    }
+
+    for (uint32_t w = 0; w < run->words; w++)
+        live |= next[w];
+    return live != 0;
+}
+
+// The supplementary block is a child of the node holding the pointer
+static int q_pointer(void* ctx, const uint8_t* data, uint32_t pos, int depth) {
+    struct q_run* run = ctx;
+    memcpy(run->sets + (depth + 1) * run->words, run->sets + depth * run->words, sizeof(uint64_t) * run->words);
+    return 1;
+}
+
+int ub_query_run(const struct ub_query_set* set, const uint8_t* data, uint32_t size, const uint32_t* bounds,
+    void (*match)(void* ctx, uint32_t query, uint32_t fpos), void* ctx) {
+    // The String Section and the properties are read in place
+    uint32_t own_bounds[ub_section_len + 1];
+    if (bounds == NULL) {
+        if (ub_validate(data, size, NULL, NULL) != 0)
+            return UB_ERRMSG(UB_SRC_FILE, UB_MSG_INVALID_FORMAT);
+        ub_section_bounds(data, size, own_bounds);
+        bounds = own_bounds;
+    }
+    if (set->step_count == 0)
+        return UB_OK;
+
+    struct q_run run = {set, data};
+    run.words = (set->step_count + 63) / 64;
+    run.sets = calloc((UB_TS_MAX_DEPTH + 2) * (size_t)run.words, sizeof(uint64_t));
+    run.match = match;
+    run.ctx = ctx;
+
+    // Names are compared against the String Section in place
+    if (set->has_names) {
+        uint32_t count = ub_buf_dword(data + bounds[UB_SECTION_SS] + 5);
+        uint32_t capacity = 16;
+        while (capacity < count * 2)
+            capacity *= 2;
+        run.ss_mask = capacity - 1;
+        run.ss_index = calloc(capacity, sizeof(uint32_t));
+
+        uint32_t pos = bounds[UB_SECTION_SS] + 9;
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t slot = ub_ss_hash(ub_buf_word(data + pos)) & run.ss_mask;
+            while (run.ss_index[slot] != 0 && ub_buf_word(data + run.ss_index[slot] - 1) != ub_buf_word(data + pos))
+                slot = (slot + 1) & run.ss_mask;
+            if (run.ss_index[slot] == 0)
+                run.ss_index[slot] = pos + 1;
+            pos += 10 + ub_buf_word(data + pos + 8);
+        }
+    }
+
+    // The first step of every query starts at the root
+    for (uint32_t i = 0; i < set->step_count; i++) {
+        if (i == 0 || set->steps[i - 1].last)
+            run.sets[i >> 6] |= 1ull << (i & 63);
+    }
+    struct ub_visitor visitor = {NULL, q_enter, NULL, q_pointer, &run};
+    ub_walk(data, size, &visitor);
+
+    free(run.ss_index);
+    free(run.sets);
+    return UB_OK;
+}
@@ -0,0 +1,175 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "uicc_bml.h"
+
+static uint32_t stats_hash(uint8_t kind, uint8_t b1, uint8_t b2, uint8_t b3, uint16_t parent_type) {
+    uint32_t key = (kind << 24) | (b1 << 16) | (b2 << 8) | b3;
+    return (key * 2654435761u) ^ (parent_type * 40503u);
+}
+
+static struct ub_stat_entry* stats_find(struct ub_stats* stats, uint8_t kind, uint8_t b1, uint8_t b2, uint8_t b3, uint16_t parent_type) {
+    uint32_t i = stats_hash(kind, b1, b2, b3, parent_type) & (stats->capacity - 1);
+    for (;;) {
+        struct ub_stat_entry* entry = stats->entries + i;
+        if (entry->kind == 0 || (entry->kind == kind && entry->b1 == b1 && entry->b2 == b2 &&
+            entry->b3 == b3 && entry->parent_type == parent_type))
+            return entry;
+        i = (i + 1) & (stats->capacity - 1);
+    }
+}
+
+static void stats_grow(struct ub_stats* stats) {
+    struct ub_stat_entry* old_entries = stats->entries;
+    uint32_t old_capacity = stats->capacity;
+
+    stats->capacity *= 2;
+    stats->entries = calloc(stats->capacity, sizeof(struct ub_stat_entry));
+    for (uint32_t i = 0; i < old_capacity; i++) {
+        struct ub_stat_entry* old = old_entries + i;
+        if (old->kind != 0)
+            *stats_find(stats, old->kind, old->b1, old->b2, old->b3, old->parent_type) = *old;
+    }
+    free(old_entries);
+}
+
+// Returns the entry of the key, creates it if it does not exist
+static struct ub_stat_entry* stats_get(struct ub_stats* stats, uint8_t kind, uint8_t b1, uint8_t b2, uint8_t b3, uint16_t parent_type) {
+    struct ub_stat_entry* entry = stats_find(stats, kind, b1, b2, b3, parent_type);
+    if (entry->kind != 0)
+        return entry;
+
+    if ((stats->used + 1) * 4 > stats->capacity * 3) {
+        stats_grow(stats);
+        entry = stats_find(stats, kind, b1, b2, b3, parent_type);
+    }
+
+    entry->kind = kind;
+    entry->b1 = b1;
+    entry->b2 = b2;
+    entry->b3 = b3;
+    entry->parent_type = parent_type;
+    entry->value_min = 0xFFFFFFFF;
+    stats->used++;
+    return entry;
+}
+
+// len is the payload length in bytes, -1 if it does not apply
+static void stats_record(struct ub_stats* stats, uint8_t kind, uint8_t b1, uint8_t b2, uint8_t b3, uint16_t parent_type, int len, uint32_t value) {
+    struct ub_stat_entry* entry = stats_get(stats, kind, b1, b2, b3, parent_type);
+
+    entry->count++;
+    if (len >= 0 && len < 32)
+        entry->len_mask |= 1u << len;
+    if (value < entry->value_min)
+        entry->value_min = value;
+    if (value > entry->value_max)
+        entry->value_max = value;
+
+    int bits = 0;
+    while (bits < 32 && (value >> bits) != 0)
+        bits++;
+    entry->value_bits[bits]++;
+}
+
+struct stats_walker {
+    struct ub_stats* stats;
+    uint32_t size;
+    uint16_t parent_types[UB_TS_MAX_DEPTH + 2];    // Object type of the node enclosing each depth
+};
+
+static void stats_command(void* ctx, const uint8_t* data, uint32_t pos, uint16_t id) {
+    struct stats_walker* w = ctx;
+    int len = ub_ac_prop_len(data[pos]);
+    stats_record(w->stats, UB_STAT_AC, data[pos], 0, 0, 0, len, ub_buf_dword(data + pos + 1));
+}
+
+static int stats_enter(void* ctx, const uint8_t* data, uint32_t pos, int depth) {
+    struct stats_walker* w = ctx;
+    uint16_t parent_type = w->parent_types[depth];
+
+    if (data[pos] == UB_TST_NODE) {
+        uint16_t type = ub_buf_word(data + pos + 1);
+        stats_record(w->stats, UB_STAT_NODE, type & 0xFF, type >> 8, 0, parent_type, -1, ub_buf_word(data + pos + 5));
+        w->parent_types[depth + 1] = type;
+    }
+    else {
+        stats_record(w->stats, UB_STAT_COLLECTION, data[pos + 2], 0, 0, parent_type, -1, ub_buf_word(data + pos + 3));
+        w->parent_types[depth + 1] = parent_type;
+    }
+    return 1;
+}
+
+static void stats_leaf(void* ctx, const uint8_t* data, uint32_t pos, int len, int depth) {
+    struct stats_walker* w = ctx;
+
+    // Without a length implied by the enclosing node, the value is read with the length the tag was stepped over by
+    int header = data[pos] == UB_TST_PROP ? 4 : 2;
+    int value_len = len >= 0 ? len : (int)(ub_ts_tag_end(data, pos, w->size) - pos) - header;
+    if (data[pos] == UB_TST_PROP)
+        stats_record(w->stats, UB_STAT_PROP, data[pos + 1], data[pos + 2], data[pos + 3], w->parent_types[depth], len, ub_ts_payload(data + pos + 4, value_len));
+    else
+        stats_record(w->stats, UB_STAT_3B, data[pos + 1], 0, 0, w->parent_types[depth], len, ub_ts_payload(data + pos + 2, value_len));
+}
+
+// Count the supplementary block as a child of the node holding the pointer
+static int stats_pointer(void* ctx, const uint8_t* data, uint32_t pos, int depth) {
+    struct stats_walker* w = ctx;
+    w->parent_types[depth + 1] = w->parent_types[depth];
+    return 1;
+}
+
+struct ub_stats* ub_new_stats(void) {
+    struct ub_stats* stats = calloc(1, sizeof(struct ub_stats));
+    stats->capacity = 1024;
+    stats->entries = calloc(stats->capacity, sizeof(struct ub_stat_entry));
+    return stats;
+}
+
+int ub_stats_add(struct ub_stats* stats, const uint8_t* data, uint32_t size, const uint32_t* bounds) {
+    if (bounds == NULL) {
+        // The Tree Section can not be found without the lengths of the sections before it
+        uint32_t own_bounds[ub_section_len + 1];
+        if (!ub_check_header_buf(data, size) || !ub_section_bounds(data, size, own_bounds)) {
+            stats->skipped++;
+            return UB_ERRMSG(UB_SRC_FILE, UB_MSG_INVALID_FORMAT);
+        }
+
+        // A binary failing the validation is walked as far as its tags can be followed
+        if (ub_validate(data, size, NULL, NULL) != 0)
+            stats->invalid++;
+    }
+    stats->files++;
+
+    struct stats_walker w = {stats, size};
+    struct ub_visitor visitor = {stats_command, stats_enter, stats_leaf, stats_pointer, &w};
+    return ub_walk(data, size, &visitor);
+}
+
+void ub_stats_merge(struct ub_stats* dst, const struct ub_stats* src) {
+    dst->files += src->files;
+    dst->skipped += src->skipped;
+    dst->invalid += src->invalid;
+
+    for (uint32_t i = 0; i < src->capacity; i++) {
+        const struct ub_stat_entry* from = src->entries + i;
+        if (from->kind == 0)
+            continue;
+
+        struct ub_stat_entry* to = stats_get(dst, from->kind, from->b1, from->b2, from->b3, from->parent_type);
+        to->count += from->count;
+        to->len_mask |= from->len_mask;
+        if (from->value_min < to->value_min)
+            to->value_min = from->value_min;
+        if (from->value_max > to->value_max)
+            to->value_max = from->value_max;
+        for (int j = 0; j < 33; j++)
+            to->value_bits[j] += from->value_bits[j];
+    }
+}
+
+void ub_free_stats(struct ub_stats* stats) {
+    free(stats->entries);
+    free(stats);
+}
@@ -0,0 +1,693 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "uicc_bml.h"
+
+// Each entry in the pointer section: DWORD id, WORD index, DWORD address
+#define PS_ENTRY_LEN 10
+// Pointers and supplementary blocks kept on the stack, more of them move to the heap
+#define V_SCRATCH_LEN 64
+
+// A pointer (0x3E) and the supplementary block it points to
+struct v_pointer {
+    uint32_t fpos;
+    uint32_t target;        // Index in blocks, resolved after the supplementary block section is checked
+};
+
+// A supplementary block and the pointers it holds, [first_pointer, next block's first_pointer)
+struct v_block {
+    uint32_t fpos;
+    uint32_t first_pointer;
+};
+
+struct ub_validator {
+    const uint8_t* data;
+    uint32_t size;
+    uint32_t ps_offset;
+    uint32_t count;
+    struct v_pointer* pointers;
+    uint32_t pointer_count;
+    uint32_t pointer_capacity;
+    struct v_block* blocks;   // In file order
+    uint32_t block_count;
+    uint32_t block_capacity;
+    void (*report)(void* ctx, uint32_t fpos, int err, const char* desc);
+    void* ctx;
+    const struct v_pointer* pointer_scratch;  // On the stack of ub_validate, pointers and blocks start there
+    const struct v_block* block_scratch;
+};
+
+static void v_report(struct ub_validator* v, uint32_t fpos, int err, const char* desc) {
+    v->count++;
+    if (v->report != NULL)
+        v->report(v->ctx, fpos, err, desc);
+}
+
+// Returns 0 if len bytes at pos run past limit
+static int v_need(struct ub_validator* v, uint32_t pos, uint32_t len, uint32_t limit, enum ub_src src) {
+    if (pos > limit || len > limit - pos) {
+        v_report(v, pos, UB_ERRMSG(src, UB_MSG_INVALID_LENGTH), "Truncated");
+        return 0;
+    }
+    return 1;
+}
+
+// Doubles an array that starts in a scratch array, returns 0 if out of memory and leaves the array as it is
+static int v_grow(void** array, uint32_t* capacity, size_t elem_size, const void* scratch) {
+    void* grown;
+    if (*array == scratch) {
+        grown = malloc(elem_size * *capacity * 2);
+        if (grown != NULL)
+            memcpy(grown, *array, elem_size * *capacity);
+    }
+    else {
+        grown = realloc(*array, elem_size * *capacity * 2);
+    }
+    if (grown == NULL)
+        return 0;
+
+    *array = grown;
+    *capacity *= 2;
+    return 1;
+}
+
+static void v_out_of_memory(struct ub_validator* v, uint32_t pos) {
+    v_report(v, pos, UB_ERRMSG(UB_SRC_FILE, UB_MSG_FAILED_UNKNOWN), "Out of memory");
+}
+
+// Payload length of a 0x3B tag, -1 if the type is unknown
+static int ts_3b_len(uint8_t type) {
+    return type == 0x09 ? 1 : type == 0x03 ? 2 : type == 0x02 ? 4 : -1;
+}
+
+// All v_ functions return the position right behind what they have checked, or 0 if they can not continue
+
+static uint32_t v_uss(struct ub_validator* v, uint32_t pos) {
+    const uint8_t* data = v->data;
+    uint32_t start = pos;
+
+    if (!v_need(v, pos, 7, v->size, UB_SRC_USS))
+        return 0;
+    if (data[pos] != 0x02)
+        v_report(v, pos, UB_ERRMSG(UB_SRC_USS, UB_MSG_INVALID_HEADER), "Unknown String Section does not start with 0x02");
+    uint32_t length = ub_buf_dword(data + pos + 1);
+    if (data[pos + 5] != 0x01)
+        v_report(v, pos + 5, UB_ERRMSG(UB_SRC_USS, UB_MSG_INVALID_FORMAT), "Expect 0x01 before the number of strings");
+    uint8_t count = data[pos + 6];
+    pos += 7;
+
+    for (int i = 0; i < count; i++) {
+        if (!v_need(v, pos, 3, v->size, UB_SRC_USS))
+            return 0;
+        if (data[pos] != 0x01)
+            v_report(v, pos, UB_ERRMSG(UB_SRC_USS, UB_MSG_INVALID_FORMAT), "String does not start with 0x01");
+        uint16_t lenStr = ub_buf_word(data + pos + 1);
+        pos += 3;
+        if (!v_need(v, pos, lenStr, v->size, UB_SRC_USS))
+            return 0;
+        pos += lenStr;
+    }
+
+    if (pos != start + length)
+        v_report(v, start + 1, UB_ERRMSG(UB_SRC_USS, UB_MSG_INVALID_LENGTH), "Section length does not match its strings");
+    return pos;
+}
+
+static uint32_t v_ac(struct ub_validator* v, uint32_t pos) {
+    const uint8_t* data = v->data;
+
+    if (!v_need(v, pos, 5, v->size, UB_SRC_AC))
+        return 0;
+    if (data[pos] != 0x0F)
+        v_report(v, pos, UB_ERRMSG(UB_SRC_AC, UB_MSG_INVALID_HEADER), "Application.Commands Section does not start with 0x0F");
+    uint32_t count = ub_buf_dword(data + pos + 1);
+    pos += 5;
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (!v_need(v, pos, 5, v->size, UB_SRC_AC))
+            return 0;
+        if (ub_buf_word(data + pos + 2) != 0x0000)
+            v_report(v, pos + 2, UB_ERRMSG(UB_SRC_AC, UB_MSG_INVALID_FORMAT), "Higher WORD of the ID is not 0");
+        uint8_t pairs = data[pos + 4];
+        pos += 5;
+
+        for (int j = 0; j < pairs; j++) {
+            if (!v_need(v, pos, 1, v->size, UB_SRC_AC))
+                return 0;
+            int len = ub_ac_prop_len(data[pos]);
+            if (len < 0) {
+                v_report(v, pos, UB_ERRMSG(UB_SRC_AC, UB_MSG_INVALID_FORMAT), "Unknown property type, its length is unknown");
+                return 0;
+            }
+            if (!v_need(v, pos, 1 + len, v->size, UB_SRC_AC))
+                return 0;
+            pos += 1 + len;
+        }
+    }
+
+    return pos;
+}
+
+static uint32_t v_ss(struct ub_validator* v, uint32_t pos) {
+    const uint8_t* data = v->data;
+    uint32_t start = pos;
+
+    if (!v_need(v, pos, 9, v->size, UB_SRC_SS))
+        return 0;
+    if (data[pos] != 0x10)
+        v_report(v, pos, UB_ERRMSG(UB_SRC_SS, UB_MSG_INVALID_HEADER), "String Section does not start with 0x10");
+    uint32_t length = ub_buf_dword(data + pos + 1);
+    uint32_t count = ub_buf_dword(data + pos + 5);
+    pos += 9;
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (!v_need(v, pos, 10, v->size, UB_SRC_SS))
+            return 0;
+        if (ub_buf_word(data + pos + 2) != 0x0000)
+            v_report(v, pos + 2, UB_ERRMSG(UB_SRC_SS, UB_MSG_INVALID_FORMAT), "Higher WORD of the ID is not 0");
+        uint16_t obj_type = ub_buf_word(data + pos + 4);
+        uint16_t magic = ub_buf_word(data + pos + 6);
+        if (magic != 0x1000 && !(magic == 0x0000 && obj_type == 0x0001))
+            v_report(v, pos + 6, UB_ERRMSG(UB_SRC_SS, UB_MSG_INVALID_FORMAT), "Expect 0x1000 after the object type");
+        uint16_t lenwchar = ub_buf_word(data + pos + 8);
+        if (lenwchar & 1)
+            v_report(v, pos + 8, UB_ERRMSG(UB_SRC_SS, UB_MSG_INVALID_LENGTH), "Odd length of a WideChar string");
+        pos += 10;
+        if (!v_need(v, pos, lenwchar, v->size, UB_SRC_SS))
+            return 0;
+        pos += lenwchar;
+    }
+
+    if (pos != start + length)
+        v_report(v, start + 1, UB_ERRMSG(UB_SRC_SS, UB_MSG_INVALID_LENGTH), "Section length does not match its strings");
+    return pos;
+}
+
+static uint32_t v_ts_tag(struct ub_validator* v, uint32_t pos, uint32_t limit, int depth) {
+    const uint8_t* data = v->data;
+
+    if (depth > UB_TS_MAX_DEPTH) {
+        v_report(v, pos, UB_ERRMSG(UB_SRC_TS, UB_MSG_INVALID_FORMAT), "Tags are nested too deep");
+        return 0;
+    }
+    if (!v_need(v, pos, 1, limit, UB_SRC_TS))
+        return 0;
+
+    switch (data[pos]) {
+    case UB_TST_NODE: {
+        if (!v_need(v, pos, 8, limit, UB_SRC_TS))
+            return 0;
+        if (ub_buf_word(data + pos + 3) != 0x1000)
+            v_report(v, pos + 3, UB_ERRMSG(UB_SRC_TS, UB_MSG_INVALID_FORMAT), "Expect 0x1000 after the object type");
+        uint16_t length = ub_buf_word(data + pos + 5);
+        uint8_t count = data[pos + 7];
+        if (length < 8 || length > limit - pos) {
+            v_report(v, pos + 5, UB_ERRMSG(UB_SRC_TS, UB_MSG_INVALID_LENGTH), "Node length does not fit in its parent");
+            return 0;
+        }
+
+        // The length of the node allows to skip over a broken child
+        uint32_t node_end = pos + length;
+        uint32_t child = pos + 8;
+        for (int i = 0; i < count; i++) {
+            child = v_ts_tag(v, child, node_end, depth + 1);
+            if (child == 0)
+                return node_end;
+        }
+
+        if (child != node_end)
+            v_report(v, pos + 5, UB_ERRMSG(UB_SRC_TS, UB_MSG_INVALID_LENGTH), "Node length does not match its children");
+        return node_end;
+    }
+    case UB_TST_COLLECTION: {
+        if (!v_need(v, pos, 5, limit, UB_SRC_TS))
+            return 0;
+        if (data[pos + 1] != 0x01)
+            v_report(v, pos + 1, UB_ERRMSG(UB_SRC_TS, UB_MSG_INVALID_FORMAT), "Expect 0x01 after 0x18");
+        uint16_t count = ub_buf_word(data + pos + 3);
+
+        uint32_t child = pos + 5;
+        for (int i = 0; i < count; i++) {
+            if (child < limit && data[child] != UB_TST_NODE && data[child] != UB_TST_3B)
+                v_report(v, child, UB_ERRMSG(UB_SRC_TS, UB_MSG_INVALID_FORMAT), "Collection holds a tag other than a node or 0x3B");
+            child = v_ts_tag(v, child, limit, depth + 1);
+            if (child == 0)
+                return 0;
+        }
+        return child;
+    }
+    case UB_TST_PROP: {
+        if (!v_need(v, pos, 4, limit, UB_SRC_TS))
+            return 0;
+        int len = ub_ts_prop_len_from_bin(data[pos + 1], data[pos + 2], data[pos + 3]);
+        if (!v_need(v, pos, 4 + len, limit, UB_SRC_TS))
+            return 0;
+        return pos + 4 + len;
+    }
+    case UB_TST_POINTER: {
+        if (!v_need(v, pos, 5, limit, UB_SRC_TS))
+            return 0;
+        // The target is checked once the start of every supplementary block is known
+        if (v->pointer_count == v->pointer_capacity &&
+            !v_grow((void**)&v->pointers, &v->pointer_capacity, sizeof(struct v_pointer), v->pointer_scratch)) {
+            v_out_of_memory(v, pos);
+            return 0;
+        }
+        v->pointers[v->pointer_count].fpos = pos;
+        v->pointers[v->pointer_count].target = 0;
+        v->pointer_count++;
+        return pos + 5;
+    }
+    case UB_TST_3B: {
+        if (!v_need(v, pos, 2, limit, UB_SRC_TS))
+            return 0;
+        int len = ts_3b_len(data[pos + 1]);
+        if (len < 0) {
+            v_report(v, pos + 1, UB_ERRMSG(UB_SRC_TS, UB_MSG_INVALID_FORMAT), "Unknown 0x3B type, its length is unknown");
+            return 0;
+        }
+        if (!v_need(v, pos, 2 + len, limit, UB_SRC_TS))
+            return 0;
+        return pos + 2 + len;
+    }
+    }
+
+    v_report(v, pos, UB_ERRMSG(UB_SRC_TS, UB_MSG_INVALID_FORMAT), "Unknown tag");
+    return 0;
+}
+
+// Each pointer must point to the start of a supplementary block, and following the pointers must not loop
+static void v_pointers(struct ub_validator* v) {
+    for (uint32_t i = 0; i < v->pointer_count; i++) {
+        struct v_pointer* pointer = &v->pointers[i];
+        uint32_t target = ub_buf_dword(v->data + pointer->fpos + 1);
+
+        // Binary search, the blocks are in file order
+        uint32_t lo = 0, hi = v->block_count;
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (v->blocks[mid].fpos < target)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (lo < v->block_count && v->blocks[lo].fpos == target) {
+            pointer->target = lo;
+        }
+        else {
+            v_report(v, pointer->fpos + 1, UB_ERRMSG(UB_SRC_TS, UB_MSG_INVALID_FORMAT), "Pointer does not point to a supplementary block");
+            pointer->target = UINT32_MAX;
+        }
+    }
+
+    // Depth-first search from every block, a block met again while it is on the stack closes a loop.
+    // state: 0 not visited, 1 on the stack, 2 done. next: the next pointer to follow in each block
+    uint32_t stack_scratch[V_SCRATCH_LEN], next_scratch[V_SCRATCH_LEN];
+    uint8_t state_scratch[V_SCRATCH_LEN];
+    uint32_t* stack = stack_scratch;
+    uint32_t* next = next_scratch;
+    uint8_t* state = state_scratch;
+    int on_heap = v->block_count > V_SCRATCH_LEN;
+    if (on_heap) {
+        stack = malloc(sizeof(uint32_t) * v->block_count);
+        next = malloc(sizeof(uint32_t) * v->block_count);
+        state = malloc(v->block_count);
+        if (stack == NULL || next == NULL || state == NULL) {
+            v_out_of_memory(v, v->blocks[0].fpos);
+            free(stack);
+            free(next);
+            free(state);
+            return;
+        }
+    }
+    memset(state, 0, v->block_count);
+    for (uint32_t root = 0; root < v->block_count; root++) {
+        if (state[root] != 0)
+            continue;
+        uint32_t top = 0;
+        stack[top++] = root;
+        state[root] = 1;
+        next[root] = v->blocks[root].first_pointer;
+
+        while (top > 0) {
+            uint32_t block = stack[top - 1];
+            uint32_t end = block + 1 < v->block_count ? v->blocks[block + 1].first_pointer : v->pointer_count;
+            if (next[block] == end) {
+                state[block] = 2;
+                top--;
+                continue;
+            }
+
+            struct v_pointer* pointer = &v->pointers[next[block]++];
+            if (pointer->target == UINT32_MAX)
+                continue;
+            if (state[pointer->target] == 1) {
+                v_report(v, pointer->fpos + 1, UB_ERRMSG(UB_SRC_TS, UB_MSG_INVALID_FORMAT), "Pointers form a loop");
+            }
+            else if (state[pointer->target] == 0) {
+                stack[top++] = pointer->target;
+                state[pointer->target] = 1;
+                next[pointer->target] = v->blocks[pointer->target].first_pointer;
+            }
+        }
+    }
+    if (on_heap) {
+        free(stack);
+        free(next);
+        free(state);
+    }
+}
+
+static uint32_t v_ts(struct ub_validator* v, uint32_t pos) {
+    const uint8_t* data = v->data;
+
+    if (!v_need(v, pos, 15, v->size, UB_SRC_TS))
+        return 0;
+    if (data[pos] != 0x0D)
+        v_report(v, pos, UB_ERRMSG(UB_SRC_TS, UB_MSG_INVALID_HEADER), "Tree Section does not start with 0x0D");
+    if (ub_buf_word(data + pos + 1) != 0x0003)
+        v_report(v, pos + 1, UB_ERRMSG(UB_SRC_TS, UB_MSG_INVALID_FORMAT), "Expect 0x0003 after 0x0D");
+    v->ps_offset = ub_buf_dword(data + pos + 3);
+    if (v->ps_offset < pos || v->ps_offset > v->size - 4) {
+        v_report(v, pos + 3, UB_ERRMSG(UB_SRC_TS, UB_MSG_INVALID_LENGTH), "ps_offset points outside of the file");
+        return 0;
+    }
+    pos += 7;
+
+    if (data[pos] != UB_TST_NODE)
+        v_report(v, pos, UB_ERRMSG(UB_SRC_TS, UB_MSG_INVALID_FORMAT), "Root tag is not a node");
+    uint32_t root_end = v_ts_tag(v, pos, v->ps_offset, 0);
+    if (root_end == 0)
+        return 0;
+
+    // Supplementary blocks, each one is a WORD length and a collection
+    pos = root_end;
+    if (!v_need(v, pos, 4, v->ps_offset, UB_SRC_TS))
+        return 0;
+    uint32_t supp_end = pos + ub_buf_dword(data + pos);
+    if (supp_end != v->ps_offset)
+        v_report(v, pos, UB_ERRMSG(UB_SRC_TS, UB_MSG_INVALID_LENGTH), "Supplementary block section does not end at ps_offset");
+    pos += 4;
+
+    while (pos < v->ps_offset) {
+        if (!v_need(v, pos, 2, v->ps_offset, UB_SRC_TS))
+            return 0;
+        uint16_t length = ub_buf_word(data + pos);
+        if (length < 2 || length > v->ps_offset - pos) {
+            v_report(v, pos, UB_ERRMSG(UB_SRC_TS, UB_MSG_INVALID_LENGTH), "Supplementary block length does not fit in the section");
+            return 0;
+        }
+
+        if (v->block_count == v->block_capacity &&
+            !v_grow((void**)&v->blocks, &v->block_capacity, sizeof(struct v_block), v->block_scratch)) {
+            v_out_of_memory(v, pos);
+            return 0;
+        }
+        v->blocks[v->block_count].fpos = pos;
+        v->blocks[v->block_count].first_pointer = v->pointer_count;
+        v->block_count++;
+
+        if (length > 2 && data[pos + 2] != UB_TST_COLLECTION)
+            v_report(v, pos + 2, UB_ERRMSG(UB_SRC_TS, UB_MSG_INVALID_FORMAT), "Supplementary block is not a collection");
+        uint32_t block_end = v_ts_tag(v, pos + 2, pos + length, 0);
+        if (block_end != 0 && block_end != pos + length)
+            v_report(v, pos, UB_ERRMSG(UB_SRC_TS, UB_MSG_INVALID_LENGTH), "Supplementary block length does not match its collection");
+        pos += length;
+    }
+
+    v_pointers(v);
+    return pos;
+}
+
+static void v_ps(struct ub_validator* v, uint32_t pos) {
+    const uint8_t* data = v->data;
+
+    uint32_t length = ub_buf_dword(data + pos);
+    if (length < 4 || pos + length != v->size) {
+        v_report(v, pos, UB_ERRMSG(UB_SRC_PS, UB_MSG_INVALID_LENGTH), "Pointer section does not end at the end of the file");
+        return;
+    }
+    if ((length - 4) % PS_ENTRY_LEN != 0)
+        v_report(v, pos, UB_ERRMSG(UB_SRC_PS, UB_MSG_INVALID_LENGTH), "Pointer section holds a partial entry");
+
+    for (uint32_t entry = pos + 4; entry + PS_ENTRY_LEN <= v->size; entry += PS_ENTRY_LEN) {
+        uint32_t addr = ub_buf_dword(data + entry + 6);
+        if (addr >= v->size || data[addr] != UB_TST_NODE)
+            v_report(v, entry + 6, UB_ERRMSG(UB_SRC_PS, UB_MSG_INVALID_FORMAT), "Entry does not point to a node");
+    }
+}
+
+uint32_t ub_validate(const uint8_t* data, uint32_t size,
+    void (*report)(void* ctx, uint32_t fpos, int err, const char* desc), void* ctx) {
+    struct v_pointer pointer_scratch[V_SCRATCH_LEN];
+    struct v_block block_scratch[V_SCRATCH_LEN];
+    struct ub_validator v = {data, size, 0, 0, pointer_scratch, 0, V_SCRATCH_LEN, block_scratch, 0, V_SCRATCH_LEN,
+        report, ctx, pointer_scratch, block_scratch};
+
+    if (!ub_check_header_buf(data, size)) {
+        v_report(&v, 0, UB_ERRMSG(UB_SRC_FILE, UB_MSG_INVALID_HEADER), "Invalid header magic number");
+        return v.count;
+    }
+    if (!v_need(&v, 14, 4, size, UB_SRC_FILE))
+        return v.count;
+    if (ub_buf_dword(data + 14) != size)
+        v_report(&v, 14, UB_ERRMSG(UB_SRC_FILE, UB_MSG_INVALID_LENGTH), "File size in the header does not match");
+
+    uint32_t pos = v_uss(&v, 18);
+    if (pos != 0)
+        pos = v_ac(&v, pos);
+    if (pos != 0)
+        pos = v_ss(&v, pos);
+    if (pos != 0)
+        pos = v_ts(&v, pos);
+    if (pos != 0)
+        v_ps(&v, pos);
+
+    if (v.pointers != v.pointer_scratch)
+        free(v.pointers);
+    if (v.blocks != v.block_scratch)
+        free(v.blocks);
+    return v.count;
+}
+
+// Tree Section walker
+
+struct walker {
+    const uint8_t* data;
+    uint32_t size;
+    uint32_t budget;        // Tags left to visit
+    const struct ub_visitor* visitor;
+};
+
+uint32_t ub_ts_payload(const uint8_t* ptr, int len) {
+    uint32_t value = 0;
+    for (int i = 0; i < len && i < 4; i++)
+        value |= (uint32_t)ptr[i] << (i * 8);
+    return value;
+}
+
+static uint32_t w_skip(const uint8_t* data, uint32_t pos, uint32_t limit, int depth) {
+    if (depth > UB_TS_MAX_DEPTH || pos >= limit)
+        return 0;
+
+    uint32_t len;
+    switch (data[pos]) {
+    case UB_TST_NODE:
+        if (limit - pos < 8)
+            return 0;
+        len = ub_buf_word(data + pos + 5);
+        if (len < 8)
+            return 0;
+        break;
+    case UB_TST_COLLECTION: {
+        if (limit - pos < 5)
+            return 0;
+        uint16_t count = ub_buf_word(data + pos + 3);
+        uint32_t child = pos + 5;
+        for (int i = 0; i < count && child != 0; i++)
+            child = w_skip(data, child, limit, depth + 1);
+        return child;
+    }
+    case UB_TST_PROP:
+        if (limit - pos < 4)
+            return 0;
+        len = 4 + ub_ts_prop_len_from_bin(data[pos + 1], data[pos + 2], data[pos + 3]);
+        break;
+    case UB_TST_POINTER:
+        len = 5;
+        break;
+    case UB_TST_3B: {
+        if (limit - pos < 2)
+            return 0;
+        int payload = ts_3b_len(data[pos + 1]);
+        if (payload < 0)
+            return 0;
+        len = 2 + payload;
+        break;
+    }
+    default:
+        return 0;
+    }
+
+    return len <= limit - pos ? pos + len : 0;
+}
+
+uint32_t ub_ts_tag_end(const uint8_t* data, uint32_t pos, uint32_t limit) {
+    return w_skip(data, pos, limit, 0);
+}
+
+// Returns 1 if the children of the node at pos fill it up to node_end, the last one taking the rest if it is a property
+static int w_fits(const uint8_t* data, uint32_t pos, uint32_t node_end) {
+    uint8_t count = data[pos + 7];
+    uint32_t child = pos + 8;
+    for (int i = 0; i < count && child != 0; i++) {
+        if (i == count - 1 && child < node_end && data[child] == UB_TST_PROP && node_end - child >= 4)
+            return 1;
+        child = w_skip(data, child, node_end, 0);
+    }
+    return child == node_end;
+}
+
+// Where the payload lengths of the tags come from
+enum w_bound {
+    W_UNBOUND,      // The enclosing node is not filled by its children, the lengths are not known
+    W_BOUND,        // The enclosing node is filled by its children with the known lengths
+    W_LAST          // Same, and the tag is the last child, a property takes the rest of the node
+};
+
+// Returns the position right behind the tag, or 0 if it is unknown or runs past limit
+static uint32_t w_tag(struct walker* w, uint32_t pos, uint32_t limit, int depth, enum w_bound bound) {
+    const uint8_t* data = w->data;
+    const struct ub_visitor* visitor = w->visitor;
+
+    // Every tag takes at least 2 bytes, more visits mean that pointers lead to the same blocks over and over
+    if (w->budget == 0 || pos >= limit)
+        return 0;
+    w->budget--;
+
+    switch (data[pos]) {
+    case UB_TST_NODE: {
+        uint32_t node_end = w_skip(data, pos, limit, 0);
+        if (node_end == 0)
+            return 0;
+        if (depth > UB_TS_MAX_DEPTH || (visitor->enter != NULL && !visitor->enter(visitor->ctx, data, pos, depth)))
+            return node_end;
+
+        // The length of the node allows to skip over a broken child
+        int fits = visitor->leaf != NULL && w_fits(data, pos, node_end);
+        uint8_t count = data[pos + 7];
+        uint32_t child = pos + 8;
+        for (int i = 0; i < count && child != 0; i++)
+            child = w_tag(w, child, node_end, depth + 1, !fits ? W_UNBOUND : i == count - 1 ? W_LAST : W_BOUND);
+        return node_end;
+    }
+    case UB_TST_COLLECTION: {
+        if (limit - pos < 5)
+            return 0;
+        if (depth > UB_TS_MAX_DEPTH || (visitor->enter != NULL && !visitor->enter(visitor->ctx, data, pos, depth)))
+            return w_skip(data, pos, limit, 0);
+
+        uint16_t count = ub_buf_word(data + pos + 3);
+        uint32_t child = pos + 5;
+        for (int i = 0; i < count && child != 0; i++)
+            child = w_tag(w, child, limit, depth + 1, bound == W_UNBOUND ? W_UNBOUND : W_BOUND);
+        return child;
+    }
+    case UB_TST_PROP:
+    case UB_TST_3B: {
+        int header = data[pos] == UB_TST_PROP ? 4 : 2;
+        uint32_t end = bound == W_LAST && header == 4 && limit - pos >= 4 ? limit : w_skip(data, pos, limit, 0);
+        if (end != 0 && visitor->leaf != NULL)
+            visitor->leaf(visitor->ctx, data, pos, bound == W_UNBOUND ? -1 : (int)(end - pos - header), depth);
+        return end;
+    }
+    case UB_TST_POINTER: {
+        if (limit - pos < 5)
+            return 0;
+        // The supplementary block is a WORD length and a collection, which must fill it
+        uint32_t target = ub_buf_dword(data + pos + 1);
+        if (depth <= UB_TS_MAX_DEPTH && visitor->pointer != NULL && target < w->size - 2 && visitor->pointer(visitor->ctx, data, pos, depth)) {
+            uint16_t length = ub_buf_word(data + target);
+            if (length <= w->size - target) {
+                int fits = visitor->leaf != NULL && w_skip(data, target + 2, target + length, 0) == target + length;
+                w_tag(w, target + 2, target + length, depth + 1, fits ? W_BOUND : W_UNBOUND);
+            }
+        }
+        return pos + 5;
+    }
+    }
+
+    return 0;
+}
+
+// Returns the position right behind the Application.Commands section at pos, or 0 if it runs past size
+static uint32_t ac_walk(const uint8_t* data, uint32_t size, uint32_t pos, const struct ub_visitor* visitor) {
+    if (pos > size || size - pos < 5)
+        return 0;
+    uint32_t count = ub_buf_dword(data + pos + 1);
+    pos += 5;
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (size - pos < 5)
+            return 0;
+        uint16_t id = ub_buf_word(data + pos);
+        uint8_t pairs = data[pos + 4];
+        pos += 5;
+        for (int j = 0; j < pairs; j++) {
+            int len = pos < size ? ub_ac_prop_len(data[pos]) : -1;
+            if (len < 0 || size - pos < 1 + (uint32_t)len)
+                return 0;
+            if (visitor != NULL && visitor->command != NULL)
+                visitor->command(visitor->ctx, data, pos, id);
+            pos += 1 + len;
+        }
+    }
+
+    return pos;
+}
+
+int ub_walk(const uint8_t* data, uint32_t size, const struct ub_visitor* visitor) {
+    uint32_t bounds[ub_section_len + 1];
+    if (!ub_section_bounds(data, size, bounds))
+        return UB_ERRMSG(UB_SRC_FILE, UB_MSG_INVALID_LENGTH);
+    if (visitor->command != NULL)
+        ac_walk(data, size, bounds[UB_SECTION_AC], visitor);
+
+    // Skip the header of the Tree Section, the root node ends before the supplementary blocks
+    uint32_t pos = bounds[UB_SECTION_TS];
+    if (size - pos < 8)
+        return UB_ERRMSG(UB_SRC_TS, UB_MSG_INVALID_LENGTH);
+    uint32_t limit = ub_buf_dword(data + pos + 3);
+    if (limit < pos + 7 || limit > size)
+        limit = size;
+
+    struct walker w = {data, size, size / 2, visitor};
+    if (w_tag(&w, pos + 7, limit, 0, W_UNBOUND) == 0)
+        return UB_ERRMSG(UB_SRC_TS, UB_MSG_INVALID_FORMAT);
+    return UB_OK;
+}
+
+int ub_section_bounds(const uint8_t* data, uint32_t size, uint32_t* bounds) {
+    if (size < 23)
+        return 0;
+    bounds[UB_SECTION_HEADER] = 0;
+    bounds[UB_SECTION_USS] = 18;
+    uint32_t length = ub_buf_dword(data + 19);
+    if (length > size - 18)
+        return 0;
+
+    // The Application.Commands section does not have a length
+    bounds[UB_SECTION_AC] = 18 + length;
+    uint32_t pos = ac_walk(data, size, bounds[UB_SECTION_AC], NULL);
+    if (pos == 0 || size - pos < 5)
+        return 0;
+    bounds[UB_SECTION_SS] = pos;
+
+    length = ub_buf_dword(data + pos + 1);
+    if (length > size - pos)
+        return 0;
+    bounds[UB_SECTION_TS] = pos + length;
+    bounds[ub_section_len] = size;
+    return 1;
+}
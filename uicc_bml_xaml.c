@@ -0,0 +1,454 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "uicc_bml.h"
+
+struct xaml_ctx {
+    FILE* out;
+    struct ub_ss* ss;
+    uint8_t emitted[0x10000 / 8];   // Command ids already written to Application.Commands
+};
+
+static const struct xaml_collection {
+    uint8_t type;
+    const char* name;
+} xaml_collections[] = {
+    {0x3E, "Items"},
+    {0x48, "MRUItems"},
+    {0x49, "FooterItems"}
+};
+
+static const char* xaml_collection_name(uint8_t type) {
+    for (int i = 0; i < sizeof(xaml_collections) / sizeof(xaml_collections[0]); i++) {
+        if (xaml_collections[i].type == type)
+            return xaml_collections[i].name;
+    }
+    return NULL;
+}
+
+static void xaml_indent(struct xaml_ctx* ctx, int level) {
+    for (int i = 0; i < level; i++)
+        fputs("    ", ctx->out);
+}
+
+// UTF-16 to UTF-8, escaped for an attribute value, or for a comment if in_comment is set.
+// Unpaired surrogates and characters not allowed in XML become U+FFFD
+static void xaml_text(struct xaml_ctx* ctx, const uint16_t* wchars, int in_comment) {
+    FILE* out = ctx->out;
+    uint32_t prev = 0;
+    uint32_t count = 0;
+    while (wchars[count] != 0)
+        count++;
+
+    for (uint32_t i = 0; i < count;) {
+        uint32_t c;
+        i += ub_utf16_get((const uint8_t*)(wchars + i), count - i, &c);
+        if (c == 0xFFFE || c == 0xFFFF || (c < 0x20 && c != 0x09 && c != 0x0A && c != 0x0D))
+            c = 0xFFFD;
+
+        if (in_comment) {
+            // "--" is not allowed within a comment
+            if (c == '-' && prev == '-')
+                putc(' ', out);
+        }
+        else if (c == '&') {
+            fputs("&amp;", out);
+            prev = c;
+            continue;
+        }
+        else if (c == '<') {
+            fputs("&lt;", out);
+            prev = c;
+            continue;
+        }
+        else if (c == '"') {
+            fputs("&quot;", out);
+            prev = c;
+            continue;
+        }
+        else if (c < 0x20) {
+            fprintf(out, "&#x%X;", c);
+            prev = c;
+            continue;
+        }
+        prev = c;
+
+        uint8_t utf8[4];
+        fwrite(utf8, 1, ub_utf8_put(c, utf8), out);
+    }
+
+    // A comment can not end with '-' either
+    if (in_comment && prev == '-')
+        putc(' ', out);
+}
+
+// UICC.exe names the commands it generates itself with their decimal id
+static int xaml_is_generated(const struct ub_ss_string* ss_string) {
+    if (ss_string->wchars[0] == 0)
+        return 1;
+    for (const uint16_t* p = ss_string->wchars; *p != 0; p++) {
+        if (*p < '0' || *p > '9')
+            return 0;
+    }
+    return 1;
+}
+
+// The name of a command which can be written as a CommandName, NULL if there is none
+static const uint16_t* xaml_command_name(struct xaml_ctx* ctx, uint32_t id) {
+    struct ub_ss_string* ss_string = id > 0xFFFF ? NULL : ub_ss_find(ctx->ss, id);
+    return (ss_string == NULL || xaml_is_generated(ss_string)) ? NULL : ss_string->wchars;
+}
+
+enum xaml_prop_kind {
+    XAML_PROP_OTHER,
+    XAML_PROP_COMMAND,
+    XAML_PROP_MODES,
+    XAML_PROP_CLASS
+};
+
+static enum xaml_prop_kind xaml_prop_kind(struct ub_ts_prop* prop) {
+    if (prop->type_b1 == 0x01 && prop->type_b2 == 0x00 && prop->type_b3 >= 0x02 && prop->type_b3 <= 0x04)
+        return XAML_PROP_COMMAND;
+    if (prop->type_b1 == 0x01 && prop->type_b2 == 0x3D && prop->type_b3 >= 0x02 && prop->type_b3 <= 0x04)
+        return XAML_PROP_MODES;
+    if (prop->type_b1 == 0x01 && prop->type_b2 == 0x41 && prop->type_b3 == 0x2B &&
+        (prop->data == 1 || prop->data == 2))
+        return XAML_PROP_CLASS;
+    return XAML_PROP_OTHER;
+}
+
+// 0 if the property has to be written to the body as a comment. An attribute can only be written once,
+// so a repeated one goes to the body as well; written holds the kinds already taken by the node
+static int xaml_is_attr(struct xaml_ctx* ctx, struct ub_ts_prop* prop, uint32_t* written) {
+    enum xaml_prop_kind kind = xaml_prop_kind(prop);
+    int is_attr;
+    switch (kind) {
+    case XAML_PROP_COMMAND:
+        is_attr = prop->data <= 0xFFFF && ub_ss_find(ctx->ss, prop->data) != NULL;
+        break;
+    case XAML_PROP_MODES:
+        is_attr = prop->data != 0;
+        break;
+    case XAML_PROP_CLASS:
+        is_attr = 1;
+        break;
+    default:
+        is_attr = 0;
+        break;
+    }
+
+    if (!is_attr || (*written & (1u << kind)))
+        return 0;
+    *written |= 1u << kind;
+    return 1;
+}
+
+static void xaml_write_attr(struct xaml_ctx* ctx, struct ub_ts_prop* prop) {
+    FILE* out = ctx->out;
+
+    switch (xaml_prop_kind(prop)) {
+    case XAML_PROP_COMMAND: {
+        // The generated ones are left out, as UICC.exe generates them again
+        const uint16_t* name = xaml_command_name(ctx, prop->data);
+        if (name != NULL) {
+            fputs(" CommandName=\"", out);
+            xaml_text(ctx, name, 0);
+            putc('"', out);
+        }
+        break;
+    }
+    case XAML_PROP_MODES: {
+        // A bit mask of the mode numbers
+        fputs(" ApplicationModes=\"", out);
+        const char* sep = "";
+        for (int i = 0; i < 32; i++) {
+            if (prop->data & (1u << i)) {
+                fprintf(out, "%s%d", sep, i);
+                sep = ",";
+            }
+        }
+        putc('"', out);
+        break;
+    }
+    case XAML_PROP_CLASS:
+        fprintf(out, " Class=\"%s\"", prop->data == 1 ? "MajorItems" : "StandardItems");
+        break;
+    default:
+        break;
+    }
+}
+
+static void xaml_write_prop_comment(struct xaml_ctx* ctx, struct ub_ts_prop* prop, int level) {
+    FILE* out = ctx->out;
+    const char* name = ub_ts_prop_name_str(prop);
+
+    xaml_indent(ctx, level);
+    if (name == NULL)
+        fprintf(out, "<!-- Unknown (01 %02X %02X %02X) =", prop->type_b1, prop->type_b2, prop->type_b3);
+    else
+        fprintf(out, "<!-- %s =", name);
+
+    int len = ub_ts_prop_len(prop);
+    if (len > 4) {
+        for (int i = 0; i < len; i++)
+            fprintf(out, " %02X", prop->data_ptr[i]);
+    }
+    else {
+        fprintf(out, " 0x%08X (%d)", prop->data, prop->data);
+        if (xaml_prop_kind(prop) == XAML_PROP_COMMAND) {
+            struct ub_ss_string* ss_string = prop->data > 0xFFFF ? NULL : ub_ss_find(ctx->ss, prop->data);
+            if (ss_string == NULL) {
+                fputs(" not in the String Section", out);
+            }
+            else {
+                putc(' ', out);
+                xaml_text(ctx, ss_string->wchars, 1);
+            }
+        }
+    }
+    fputs(" -->\n", out);
+}
+
+static void xaml_write_tag(struct xaml_ctx* ctx, void* tag, int level);
+
+static void xaml_write_coll(struct xaml_ctx* ctx, struct ub_ts_collection* coll, int level) {
+    const char* name = xaml_collection_name(coll->type);
+    if (coll->type != 0x3E) {
+        xaml_indent(ctx, level);
+        if (name == NULL)
+            fprintf(ctx->out, "<!-- Collection 0x%02X -->\n", coll->type);
+        else
+            fprintf(ctx->out, "<!-- %s -->\n", name);
+    }
+
+    for (int i = 0; i < coll->child_count; i++)
+        xaml_write_tag(ctx, coll->child_ptrs[i], level);
+}
+
+static void xaml_write_node(struct xaml_ctx* ctx, struct ub_ts_node* node, int level) {
+    FILE* out = ctx->out;
+    const char* name = ub_obj_type_element(node->type);
+
+    // An unknown node is not in the Ribbon schema, only its children are written, between two comments.
+    // So is a gallery: the schema has no bare Gallery, and the binary does not tell which one it is
+    // (DropDownGallery, InRibbonGallery, SplitButtonGallery...)
+    if (name == NULL || node->type == UBO_Gallery) {
+        xaml_indent(ctx, level);
+        fprintf(out, "<!-- Node 0x%04X (%s) -->\n", node->type, ub_obj_type_str(node->type));
+        for (int i = 0; i < node->child_count; i++)
+            xaml_write_tag(ctx, node->child_ptrs[i], level);
+        xaml_indent(ctx, level);
+        fprintf(out, "<!-- End of Node 0x%04X -->\n", node->type);
+        return;
+    }
+
+    xaml_indent(ctx, level);
+    fprintf(out, "<%s", name);
+
+    // Attributes first, whatever remains goes to the body
+    int has_body = 0;
+    uint32_t written = 0;
+    for (int i = 0; i < node->child_count; i++) {
+        struct ub_ts_prop* prop = node->child_ptrs[i];
+        if (prop->tag_type == UB_TST_PROP && xaml_is_attr(ctx, prop, &written))
+            xaml_write_attr(ctx, prop);
+        else
+            has_body = 1;
+    }
+
+    if (!has_body) {
+        fputs("/>\n", out);
+        return;
+    }
+    fputs(">\n", out);
+
+    // The same decisions again, in the same order
+    written = 0;
+    for (int i = 0; i < node->child_count; i++) {
+        struct ub_ts_prop* prop = node->child_ptrs[i];
+        if (prop->tag_type != UB_TST_PROP)
+            xaml_write_tag(ctx, prop, level + 1);
+        else if (!xaml_is_attr(ctx, prop, &written))
+            xaml_write_prop_comment(ctx, prop, level + 1);
+    }
+
+    xaml_indent(ctx, level);
+    fprintf(out, "</%s>\n", name);
+}
+
+static void xaml_write_tag(struct xaml_ctx* ctx, void* tag, int level) {
+    FILE* out = ctx->out;
+
+    enum ub_ts_type tag_type = *((enum ub_ts_type*)tag);
+    if (tag_type == UB_TST_NODE) {
+        xaml_write_node(ctx, tag, level);
+    }
+    else if (tag_type == UB_TST_COLLECTION) {
+        xaml_write_coll(ctx, tag, level);
+    }
+    else if (tag_type == UB_TST_POINTER) {
+        // The supplementary block is written in place
+        struct ub_ts_pointer* pointer = tag;
+        if (pointer->target_coll != NULL) {
+            xaml_write_coll(ctx, pointer->target_coll, level);
+        }
+        else {
+            xaml_indent(ctx, level);
+            fprintf(out, "<!-- Pointer -> 0x%08X -->\n", pointer->target_addr);
+        }
+    }
+    else if (tag_type == UB_TST_3B) {
+        struct ub_ts_3B* ts3b = tag;
+        xaml_indent(ctx, level);
+        fprintf(out, "<!-- TS3B 0x%02X = 0x%X", ts3b->type, ts3b->data);
+        struct ub_ss_string* ss_string = ts3b->type == 0x09 || ts3b->data > 0xFFFF ? NULL : ub_ss_find(ctx->ss, ts3b->data);
+        if (ss_string != NULL) {
+            putc(' ', out);
+            xaml_text(ctx, ss_string->wchars, 1);
+        }
+        fputs(" -->\n", out);
+    }
+    else {
+        xaml_write_prop_comment(ctx, tag, level);
+    }
+}
+
+// The ribbon itself, its collections become the property elements of Ribbon
+static void xaml_write_ribbon(struct xaml_ctx* ctx, struct ub_ts_node* root, int level) {
+    FILE* out = ctx->out;
+
+    xaml_indent(ctx, level);
+    fputs("<Ribbon>\n", out);
+
+    for (int i = 0; i < root->child_count; i++) {
+        struct ub_ts_collection* coll = root->child_ptrs[i];
+        const char* wrapper = NULL;
+        if (coll->tag_type == UB_TST_COLLECTION && coll->type == 0x00)
+            wrapper = "Ribbon.ApplicationMenu";
+        else if (coll->tag_type == UB_TST_COLLECTION && coll->type == 0x02)
+            wrapper = "Ribbon.Tabs";
+        else if (coll->tag_type == UB_TST_NODE && ((struct ub_ts_node*)coll)->type == UBO_QAT)
+            wrapper = "Ribbon.QuickAccessToolbar";
+
+        if (wrapper == NULL) {
+            xaml_write_tag(ctx, coll, level + 1);
+            continue;
+        }
+
+        xaml_indent(ctx, level + 1);
+        fprintf(out, "<%s>\n", wrapper);
+        if (coll->tag_type == UB_TST_COLLECTION) {
+            for (int j = 0; j < coll->child_count; j++)
+                xaml_write_tag(ctx, coll->child_ptrs[j], level + 2);
+        }
+        else {
+            xaml_write_tag(ctx, coll, level + 2);
+        }
+        xaml_indent(ctx, level + 1);
+        fprintf(out, "</%s>\n", wrapper);
+    }
+
+    xaml_indent(ctx, level);
+    fputs("</Ribbon>\n", out);
+}
+
+static void xaml_write_command(struct xaml_ctx* ctx, struct ub_ac_tag* tag, int level) {
+    FILE* out = ctx->out;
+    const uint16_t* name = xaml_command_name(ctx, tag->id);
+
+    xaml_indent(ctx, level);
+    fputs("<Command", out);
+    if (name != NULL) {
+        fputs(" Name=\"", out);
+        xaml_text(ctx, name, 0);
+        putc('"', out);
+    }
+    fprintf(out, " Id=\"%d\"", tag->id);
+    if (tag->count == 0) {
+        fputs("/>\n", out);
+        return;
+    }
+    fputs(">\n", out);
+
+    // Consecutive pairs of the same type, e.g. the images of each DPI, share one property element
+    for (int i = 0; i < tag->count; i++) {
+        struct ub_ac_pair* pair = tag->properties[i];
+        struct ub_ac_pair* prev = i > 0 ? tag->properties[i - 1] : NULL;
+        struct ub_ac_pair* next = i + 1 < tag->count ? tag->properties[i + 1] : NULL;
+        int is_image = pair->type >= 0x03 && pair->type <= 0x06;
+
+        if (ub_ac_prop_len(pair->type) < 0) {
+            xaml_indent(ctx, level + 1);
+            fprintf(out, "<!-- Unknown (0x%02X) = 0x%X -->\n", (int)pair->type, pair->value);
+            continue;
+        }
+
+        if (prev == NULL || prev->type != pair->type) {
+            xaml_indent(ctx, level + 1);
+            fprintf(out, "<%s>\n", ub_prop_type_str(pair->type));
+        }
+
+        xaml_indent(ctx, level + 2);
+        if (is_image)
+            fprintf(out, "<Image Id=\"%d\" MinDPI=\"%d\"/>\n", pair->value, pair->auxdata);
+        else
+            fprintf(out, "<String Id=\"%d\"/>\n", pair->value);
+
+        if (next == NULL || next->type != pair->type) {
+            xaml_indent(ctx, level + 1);
+            fprintf(out, "</%s>\n", ub_prop_type_str(pair->type));
+        }
+    }
+
+    xaml_indent(ctx, level);
+    fputs("</Command>\n", out);
+}
+
+int ub_write_xaml(struct ub_doc* doc, FILE* out) {
+    struct xaml_ctx* ctx = calloc(1, sizeof(struct xaml_ctx));
+    if (ctx == NULL)
+        return UB_FAILED;
+    ctx->out = out;
+    ctx->ss = doc->ss;
+
+    fputs("<?xml version=\"1.0\" encoding=\"utf-8\"?>\n", out);
+    fputs("<Application xmlns=\"http://schemas.microsoft.com/windows/2009/Ribbon\">\n", out);
+
+    xaml_indent(ctx, 1);
+    fputs("<Application.Commands>\n", out);
+    for (uint32_t i = 0; i < doc->ac->count; i++) {
+        struct ub_ac_tag* tag = doc->ac->tags[i];
+        xaml_write_command(ctx, tag, 2);
+        ctx->emitted[tag->id >> 3] |= 1 << (tag->id & 7);
+    }
+
+    // Commands without any resource only appear in the String Section
+    for (uint32_t i = 0; i < doc->ss->count; i++) {
+        struct ub_ss_string* ss_string = doc->ss->strings[i];
+        if ((ctx->emitted[ss_string->id >> 3] & (1 << (ss_string->id & 7))) || xaml_is_generated(ss_string))
+            continue;
+        ctx->emitted[ss_string->id >> 3] |= 1 << (ss_string->id & 7);
+
+        xaml_indent(ctx, 2);
+        fputs("<Command Name=\"", out);
+        xaml_text(ctx, ss_string->wchars, 0);
+        fprintf(out, "\" Id=\"%d\"/>\n", ss_string->id);
+    }
+    xaml_indent(ctx, 1);
+    fputs("</Application.Commands>\n", out);
+
+    xaml_indent(ctx, 1);
+    fputs("<Application.Views>\n", out);
+    if (doc->root->type == UBO_Ribbon)
+        xaml_write_ribbon(ctx, doc->root, 2);
+    else
+        xaml_write_node(ctx, doc->root, 2);
+    xaml_indent(ctx, 1);
+    fputs("</Application.Views>\n", out);
+
+    fputs("</Application>\n", out);
+
+    free(ctx);
+    return ferror(out) ? UB_ERRMSG(UB_SRC_FILE, UB_MSG_FAILED_UNKNOWN) : UB_OK;
+}